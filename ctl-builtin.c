@@ -0,0 +1,210 @@
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "ipc.h"
+
+static void usage(const char *progname) {
+	fprintf(stderr, "Usage: %s [command]\n"
+			"Accepted commands:\n"
+			"  reload - reload the config file\n"
+			"  switch <profile> - apply the specified profile\n"
+			"  apply [--keep] <path|-> - apply a profile read from a file\n"
+			"  test <profile> - check whether the compositor accepts a profile\n"
+			"  status [--json] - show the current profile and outputs\n"
+			"  monitor - print profile and output events as they happen\n"
+			"  log - print the recent debug messages of the daemon\n",
+			progname);
+}
+
+static int connect_daemon(void) {
+	char address[PATH_MAX];
+	if (get_ipc_address(address, sizeof(address), NULL) < 0) {
+		return -1;
+	}
+	const char *path = address + strlen("unix:");
+
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "IPC socket path too long: %s\n", path);
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) {
+		perror("socket failed");
+		return -1;
+	}
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+		fprintf(stderr, "Couldn't connect to kanshi at %s.\n"
+				"Is the kanshi daemon running?\n", address);
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static char *read_file(const char *path) {
+	FILE *f = stdin;
+	if (strcmp(path, "-") != 0) {
+		f = fopen(path, "r");
+		if (f == NULL) {
+			fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+			return NULL;
+		}
+	}
+
+	char *buf = NULL;
+	size_t len = 0, cap = 0;
+	while (true) {
+		if (len + 1 >= cap) {
+			cap = cap ? 2 * cap : 4096;
+			char *new_buf = realloc(buf, cap);
+			if (new_buf == NULL) {
+				free(buf);
+				buf = NULL;
+				break;
+			}
+			buf = new_buf;
+		}
+		size_t n = fread(buf + len, 1, cap - len - 1, f);
+		len += n;
+		if (n == 0) {
+			buf[len] = '\0';
+			break;
+		}
+	}
+
+	if (ferror(f)) {
+		fprintf(stderr, "Failed to read %s\n", path);
+		free(buf);
+		buf = NULL;
+	}
+	if (f != stdin) {
+		fclose(f);
+	}
+	return buf;
+}
+
+static int send_all(int fd, const char *buf, size_t len) {
+	while (len > 0) {
+		ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		} else if (n < 0) {
+			fprintf(stderr, "failed to send request: %s\n", strerror(errno));
+			return -1;
+		}
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+// Prints the reply, returns the exit status
+static int read_reply(int fd) {
+	FILE *f = fdopen(fd, "r");
+	if (f == NULL) {
+		perror("fdopen failed");
+		close(fd);
+		return EXIT_FAILURE;
+	}
+
+	char status[16];
+	if (fgets(status, sizeof(status), f) == NULL) {
+		fprintf(stderr, "kanshi closed the connection\n");
+		fclose(f);
+		return EXIT_FAILURE;
+	}
+	bool ok = strcmp(status, "ok\n") == 0;
+	FILE *out = ok ? stdout : stderr;
+
+	char buf[4096];
+	size_t n;
+	while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+		fwrite(buf, 1, n, out);
+		fflush(out);
+	}
+	fclose(f);
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+int main(int argc, char *argv[]) {
+	if (argc < 2) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+	if (strcmp(argv[1], "-h") == 0 || strcmp(argv[1], "--help") == 0) {
+		usage(argv[0]);
+		return EXIT_SUCCESS;
+	}
+
+	char request[512];
+	char *body = NULL;
+	if ((strcmp(argv[1], "reload") == 0 || strcmp(argv[1], "status") == 0 ||
+			strcmp(argv[1], "monitor") == 0 ||
+			strcmp(argv[1], "log") == 0) && argc == 2) {
+		snprintf(request, sizeof(request), "%s\n", argv[1]);
+	} else if (strcmp(argv[1], "status") == 0 && argc == 3 &&
+			strcmp(argv[2], "--json") == 0) {
+		snprintf(request, sizeof(request), "status --json\n");
+	} else if ((strcmp(argv[1], "switch") == 0 ||
+			strcmp(argv[1], "test") == 0) && argc == 3) {
+		if (strchr(argv[2], '\n') != NULL || strlen(argv[1]) +
+				strlen(argv[2]) + strlen(" \n") >= sizeof(request)) {
+			fprintf(stderr, "invalid profile name: %s\n", argv[2]);
+			return EXIT_FAILURE;
+		}
+		snprintf(request, sizeof(request), "%s %s\n", argv[1], argv[2]);
+	} else if (strcmp(argv[1], "apply") == 0) {
+		bool keep = false;
+		const char *path = NULL;
+		for (int i = 2; i < argc; i++) {
+			if (strcmp(argv[i], "--keep") == 0) {
+				keep = true;
+			} else if (path == NULL) {
+				path = argv[i];
+			} else {
+				usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+		}
+		if (path == NULL) {
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+		body = read_file(path);
+		if (body == NULL) {
+			return EXIT_FAILURE;
+		}
+		// The config text follows the request line
+		snprintf(request, sizeof(request), "apply %s%zu\n",
+			keep ? "--keep " : "", strlen(body));
+	} else {
+		fprintf(stderr, "invalid command: %s\n", argv[1]);
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	int fd = connect_daemon();
+	if (fd < 0) {
+		free(body);
+		return EXIT_FAILURE;
+	}
+	if (send_all(fd, request, strlen(request)) != 0 || (body != NULL &&
+			send_all(fd, body, strlen(body)) != 0)) {
+		free(body);
+		close(fd);
+		return EXIT_FAILURE;
+	}
+	free(body);
+	return read_reply(fd);
+}
@@ -1,7 +1,9 @@
 #define _POSIX_C_SOURCE 200809L
 #include <errno.h>
 #include <fcntl.h>
+#include <inttypes.h>
 #include <limits.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -13,15 +15,298 @@
 static void usage(const char *progname) {
 	fprintf(stderr, "Usage: %s [command]\n"
 			"Accepted commands:\n"
-			"  reload - reload the config file\n",
+			"  reload - reload the config file\n"
+			"  switch <profile> - apply the specified profile\n"
+			"  apply [--keep] <path|-> - apply a profile read from a file\n"
+			"  test <profile> - check whether the compositor accepts a profile\n"
+			"  status [--json] - show the current profile and outputs\n"
+			"  monitor - print profile and output events as they happen\n"
+			"  log - print the recent debug messages of the daemon\n",
 			progname);
 }
 
-static long reload_callback(VarlinkConnection *connection, const char *error,
+static long apply_callback(VarlinkConnection *connection, const char *error,
 		VarlinkObject *parameters, uint64_t flags, void *userdata) {
+	int *ret = userdata;
+	if (error != NULL) {
+		fprintf(stderr, "Error: %s\n", error);
+		*ret = EXIT_FAILURE;
+		return varlink_connection_close(connection);
+	}
+
+	const char *profile = NULL, *result = "";
+	varlink_object_get_string(parameters, "profile", &profile);
+	varlink_object_get_string(parameters, "result", &result);
+	bool ok = strcmp(result, "succeeded") == 0 ||
+		strcmp(result, "unchanged") == 0;
+	if (strcmp(result, "no-match") == 0) {
+		printf("No profile matched\n");
+	} else if (profile == NULL) {
+		// A reload destroyed the profile meanwhile
+		if (ok) {
+			printf("Configuration applied\n");
+		} else {
+			fprintf(stderr, "Failed to apply configuration: %s\n", result);
+			*ret = EXIT_FAILURE;
+		}
+	} else if (strcmp(result, "succeeded") == 0) {
+		printf("Profile '%s' applied\n", profile);
+	} else if (strcmp(result, "unchanged") == 0) {
+		printf("Profile '%s' already applied\n", profile);
+	} else {
+		fprintf(stderr, "Failed to apply profile '%s': %s\n", profile, result);
+		*ret = EXIT_FAILURE;
+	}
 	return varlink_connection_close(connection);
 }
 
+// "Profile 'name'", or "Configuration" if the reply has no profile
+static void print_subject(FILE *f, const char *profile) {
+	if (profile != NULL) {
+		fprintf(f, "Profile '%s'", profile);
+	} else {
+		fprintf(f, "Configuration");
+	}
+}
+
+static long test_callback(VarlinkConnection *connection, const char *error,
+		VarlinkObject *parameters, uint64_t flags, void *userdata) {
+	int *ret = userdata;
+	if (error != NULL) {
+		fprintf(stderr, "Error: %s\n", error);
+		*ret = EXIT_FAILURE;
+		return varlink_connection_close(connection);
+	}
+
+	const char *profile = NULL, *result = "", *plan = "";
+	varlink_object_get_string(parameters, "profile", &profile);
+	varlink_object_get_string(parameters, "result", &result);
+	varlink_object_get_string(parameters, "plan", &plan);
+	printf("%s", plan);
+	if (strcmp(result, "succeeded") == 0) {
+		print_subject(stdout, profile);
+		printf(" accepted by the compositor\n");
+	} else {
+		print_subject(stderr, profile);
+		if (strcmp(result, "no-match") == 0) {
+			fprintf(stderr, " doesn't match the connected outputs\n");
+		} else if (strcmp(result, "cancelled") == 0) {
+			fprintf(stderr, " test cancelled\n");
+		} else {
+			fprintf(stderr, " rejected by the compositor\n");
+		}
+		*ret = EXIT_FAILURE;
+	}
+	return varlink_connection_close(connection);
+}
+
+static void print_mode(VarlinkObject *mode) {
+	int64_t width = 0, height = 0, refresh = 0;
+	varlink_object_get_int(mode, "width", &width);
+	varlink_object_get_int(mode, "height", &height);
+	varlink_object_get_int(mode, "refresh", &refresh);
+	printf("%" PRId64 "x%" PRId64 "@%.3fHz", width, height,
+		(double)refresh / 1000);
+}
+
+static void print_head(VarlinkObject *head) {
+	const char *name = "", *description = "", *transform = "";
+	bool enabled = false;
+	int64_t x = 0, y = 0;
+	double scale = 1;
+	varlink_object_get_string(head, "name", &name);
+	varlink_object_get_string(head, "description", &description);
+	varlink_object_get_bool(head, "enabled", &enabled);
+	varlink_object_get_int(head, "x", &x);
+	varlink_object_get_int(head, "y", &y);
+	varlink_object_get_float(head, "scale", &scale);
+	varlink_object_get_string(head, "transform", &transform);
+	bool adaptive_sync = false;
+	varlink_object_get_bool(head, "adaptive_sync", &adaptive_sync);
+
+	printf("Output %s \"%s\"\n", name, description);
+	const char *identifier;
+	if (varlink_object_get_string(head, "identifier", &identifier) == 0) {
+		printf("  Identifier: %s\n", identifier);
+	}
+	printf("  Enabled: %s\n", enabled ? "yes" : "no");
+	VarlinkObject *current_mode;
+	if (varlink_object_get_object(head, "current_mode", &current_mode) == 0) {
+		bool custom = false;
+		varlink_object_get_bool(current_mode, "custom", &custom);
+		printf("  Mode: ");
+		print_mode(current_mode);
+		printf("%s\n", custom ? " (custom)" : "");
+	}
+	printf("  Position: %" PRId64 ",%" PRId64 "\n", x, y);
+	printf("  Scale: %f\n", scale);
+	printf("  Transform: %s\n", transform);
+	printf("  Adaptive sync: %s\n", adaptive_sync ? "yes" : "no");
+	const char *criteria;
+	if (varlink_object_get_string(head, "criteria", &criteria) == 0) {
+		printf("  Profile output: %s\n", criteria);
+	}
+
+	VarlinkArray *modes;
+	if (varlink_object_get_array(head, "modes", &modes) == 0) {
+		printf("  Modes:\n");
+		long n = varlink_array_get_n_elements(modes);
+		for (long i = 0; i < n; i++) {
+			VarlinkObject *mode;
+			if (varlink_array_get_object(modes, i, &mode) != 0) {
+				continue;
+			}
+			bool preferred = false;
+			varlink_object_get_bool(mode, "preferred", &preferred);
+			printf("    ");
+			print_mode(mode);
+			printf("%s\n", preferred ? " (preferred)" : "");
+		}
+	}
+}
+
+struct status_request {
+	bool json;
+	int ret;
+};
+
+static long status_callback(VarlinkConnection *connection, const char *error,
+		VarlinkObject *parameters, uint64_t flags, void *userdata) {
+	struct status_request *request = userdata;
+	if (error != NULL) {
+		fprintf(stderr, "Status failed: %s\n", error);
+		request->ret = EXIT_FAILURE;
+		return varlink_connection_close(connection);
+	}
+
+	if (request->json) {
+		char *str;
+		if (varlink_object_to_json(parameters, &str) < 0) {
+			fprintf(stderr, "Failed to encode status as JSON\n");
+			request->ret = EXIT_FAILURE;
+			return varlink_connection_close(connection);
+		}
+		printf("%s\n", str);
+		free(str);
+		return varlink_connection_close(connection);
+	}
+
+	const char *current_profile = NULL, *pending_profile = NULL;
+	varlink_object_get_string(parameters, "current_profile", &current_profile);
+	varlink_object_get_string(parameters, "pending_profile", &pending_profile);
+	printf("Current profile: %s\n",
+		current_profile ? current_profile : "(none)");
+	if (pending_profile != NULL) {
+		printf("Pending profile: %s\n", pending_profile);
+	}
+
+	VarlinkArray *heads;
+	if (varlink_object_get_array(parameters, "heads", &heads) == 0) {
+		long n = varlink_array_get_n_elements(heads);
+		for (long i = 0; i < n; i++) {
+			VarlinkObject *head;
+			if (varlink_array_get_object(heads, i, &head) == 0) {
+				printf("\n");
+				print_head(head);
+			}
+		}
+	}
+	return varlink_connection_close(connection);
+}
+
+static long monitor_callback(VarlinkConnection *connection, const char *error,
+		VarlinkObject *parameters, uint64_t flags, void *userdata) {
+	int *ret = userdata;
+	if (error != NULL) {
+		fprintf(stderr, "Monitor failed: %s\n", error);
+		*ret = EXIT_FAILURE;
+		return varlink_connection_close(connection);
+	}
+
+	const char *event = "", *profile = NULL, *output = NULL;
+	varlink_object_get_string(parameters, "event", &event);
+	varlink_object_get_string(parameters, "profile", &profile);
+	varlink_object_get_string(parameters, "output", &output);
+	printf("%s", event);
+	if (profile != NULL) {
+		printf(" profile=\"%s\"", profile);
+	}
+	if (output != NULL) {
+		printf(" output=\"%s\"", output);
+	}
+	printf("\n");
+	fflush(stdout);
+
+	if (!(flags & VARLINK_REPLY_CONTINUES)) {
+		return varlink_connection_close(connection);
+	}
+	return 0;
+}
+
+static long log_callback(VarlinkConnection *connection, const char *error,
+		VarlinkObject *parameters, uint64_t flags, void *userdata) {
+	int *ret = userdata;
+	if (error != NULL) {
+		fprintf(stderr, "Log failed: %s\n", error);
+		*ret = EXIT_FAILURE;
+		return varlink_connection_close(connection);
+	}
+
+	VarlinkArray *lines;
+	if (varlink_object_get_array(parameters, "lines", &lines) == 0) {
+		long n = varlink_array_get_n_elements(lines);
+		for (long i = 0; i < n; i++) {
+			const char *line;
+			if (varlink_array_get_string(lines, i, &line) == 0) {
+				printf("%s\n", line);
+			}
+		}
+	}
+	return varlink_connection_close(connection);
+}
+
+static char *read_file(const char *path) {
+	FILE *f = stdin;
+	if (strcmp(path, "-") != 0) {
+		f = fopen(path, "r");
+		if (f == NULL) {
+			fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+			return NULL;
+		}
+	}
+
+	char *buf = NULL;
+	size_t len = 0, cap = 0;
+	while (true) {
+		if (len + 1 >= cap) {
+			cap = cap ? 2 * cap : 4096;
+			char *new_buf = realloc(buf, cap);
+			if (new_buf == NULL) {
+				free(buf);
+				buf = NULL;
+				break;
+			}
+			buf = new_buf;
+		}
+		size_t n = fread(buf + len, 1, cap - len - 1, f);
+		len += n;
+		if (n == 0) {
+			buf[len] = '\0';
+			break;
+		}
+	}
+
+	if (ferror(f)) {
+		fprintf(stderr, "Failed to read %s\n", path);
+		free(buf);
+		buf = NULL;
+	}
+	if (f != stdin) {
+		fclose(f);
+	}
+	return buf;
+}
+
 static int set_blocking(int fd) {
 	int flags = fcntl(fd, F_GETFL);
 	if (flags == -1) {
@@ -66,7 +351,7 @@ int main(int argc, char *argv[]) {
 
 	VarlinkConnection *connection;
 	char address[PATH_MAX];
-	if (get_ipc_address(address, sizeof(address)) < 0) {
+	if (get_ipc_address(address, sizeof(address), NULL) < 0) {
 		return EXIT_FAILURE;
 	}
 	if (varlink_connection_new(&connection, address) != 0) {
@@ -75,14 +360,148 @@ int main(int argc, char *argv[]) {
 		return EXIT_FAILURE;
 	}
 	if (strcmp(argv[1], "reload") == 0) {
+		int ret = EXIT_SUCCESS;
+		long result = varlink_connection_call(connection,
+				"fr.emersion.kanshi.Reload", NULL, 0, apply_callback, &ret);
+		if (result != 0) {
+			fprintf(stderr, "varlink_connection_call failed: %s\n",
+					varlink_error_string(-result));
+			return EXIT_FAILURE;
+		}
+		if (wait_for_event(connection) != 0) {
+			return EXIT_FAILURE;
+		}
+		return ret;
+	} else if (strcmp(argv[1], "switch") == 0) {
+		if (argc != 3) {
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+		VarlinkObject *parameters;
+		varlink_object_new(&parameters);
+		varlink_object_set_string(parameters, "profile", argv[2]);
+		int ret = EXIT_SUCCESS;
+		long result = varlink_connection_call(connection,
+				"fr.emersion.kanshi.Switch", parameters, 0, apply_callback, &ret);
+		varlink_object_unref(parameters);
+		if (result != 0) {
+			fprintf(stderr, "varlink_connection_call failed: %s\n",
+					varlink_error_string(-result));
+			return EXIT_FAILURE;
+		}
+		if (wait_for_event(connection) != 0) {
+			return EXIT_FAILURE;
+		}
+		return ret;
+	} else if (strcmp(argv[1], "test") == 0) {
+		if (argc != 3) {
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+		VarlinkObject *parameters;
+		varlink_object_new(&parameters);
+		varlink_object_set_string(parameters, "profile", argv[2]);
+		int ret = EXIT_SUCCESS;
+		long result = varlink_connection_call(connection,
+				"fr.emersion.kanshi.Test", parameters, 0, test_callback, &ret);
+		varlink_object_unref(parameters);
+		if (result != 0) {
+			fprintf(stderr, "varlink_connection_call failed: %s\n",
+					varlink_error_string(-result));
+			return EXIT_FAILURE;
+		}
+		if (wait_for_event(connection) != 0) {
+			return EXIT_FAILURE;
+		}
+		return ret;
+	} else if (strcmp(argv[1], "apply") == 0) {
+		bool keep = false;
+		const char *path = NULL;
+		for (int i = 2; i < argc; i++) {
+			if (strcmp(argv[i], "--keep") == 0) {
+				keep = true;
+			} else if (path == NULL) {
+				path = argv[i];
+			} else {
+				usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+		}
+		if (path == NULL) {
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+		char *config = read_file(path);
+		if (config == NULL) {
+			return EXIT_FAILURE;
+		}
+		VarlinkObject *parameters;
+		varlink_object_new(&parameters);
+		varlink_object_set_string(parameters, "config", config);
+		varlink_object_set_bool(parameters, "keep", keep);
+		free(config);
+		int ret = EXIT_SUCCESS;
+		long result = varlink_connection_call(connection,
+				"fr.emersion.kanshi.Apply", parameters, 0, apply_callback, &ret);
+		varlink_object_unref(parameters);
+		if (result != 0) {
+			fprintf(stderr, "varlink_connection_call failed: %s\n",
+					varlink_error_string(-result));
+			return EXIT_FAILURE;
+		}
+		if (wait_for_event(connection) != 0) {
+			return EXIT_FAILURE;
+		}
+		return ret;
+	} else if (strcmp(argv[1], "status") == 0) {
+		struct status_request request = { .ret = EXIT_SUCCESS };
+		for (int i = 2; i < argc; i++) {
+			if (strcmp(argv[i], "--json") == 0) {
+				request.json = true;
+			} else {
+				fprintf(stderr, "invalid status argument: %s\n", argv[i]);
+				return EXIT_FAILURE;
+			}
+		}
+		long result = varlink_connection_call(connection,
+				"fr.emersion.kanshi.Status", NULL, 0, status_callback,
+				&request);
+		if (result != 0) {
+			fprintf(stderr, "varlink_connection_call failed: %s\n",
+					varlink_error_string(-result));
+			return EXIT_FAILURE;
+		}
+		if (wait_for_event(connection) != 0) {
+			return EXIT_FAILURE;
+		}
+		return request.ret;
+	} else if (strcmp(argv[1], "monitor") == 0) {
+		int ret = EXIT_SUCCESS;
+		long result = varlink_connection_call(connection,
+				"fr.emersion.kanshi.Monitor", NULL, VARLINK_CALL_MORE,
+				monitor_callback, &ret);
+		if (result != 0) {
+			fprintf(stderr, "varlink_connection_call failed: %s\n",
+					varlink_error_string(-result));
+			return EXIT_FAILURE;
+		}
+		if (wait_for_event(connection) != 0) {
+			return EXIT_FAILURE;
+		}
+		return ret;
+	} else if (strcmp(argv[1], "log") == 0) {
+		int ret = EXIT_SUCCESS;
 		long result = varlink_connection_call(connection,
-				"fr.emersion.kanshi.Reload", NULL, 0, reload_callback, NULL);
+				"fr.emersion.kanshi.Log", NULL, 0, log_callback, &ret);
 		if (result != 0) {
 			fprintf(stderr, "varlink_connection_call failed: %s\n",
 					varlink_error_string(-result));
 			return EXIT_FAILURE;
 		}
-		return wait_for_event(connection);
+		if (wait_for_event(connection) != 0) {
+			return EXIT_FAILURE;
+		}
+		return ret;
 	}
 	fprintf(stderr, "invalid command: %s\n", argv[1]);
 	usage(argv[0]);
@@ -3,36 +3,41 @@
 #include <fcntl.h>
 #include <poll.h>
 #include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
+#include "ipc.h"
 #include "kanshi.h"
-
-#if KANSHI_HAS_VARLINK
-#include <varlink.h>
-#endif
+#include "log.h"
+#include "metrics.h"
 
 static int set_pipe_flags(int fd) {
 	int flags = fcntl(fd, F_GETFL);
 	if (flags == -1) {
-		perror("fnctl F_GETFL failed");
+		kanshi_log(KANSHI_LOG_ERROR, "fnctl F_GETFL failed: %s",
+			strerror(errno));
 		return -1;
 	}
 	flags |= O_NONBLOCK;
 	if (fcntl(fd, F_SETFL, flags) == -1) {
-		perror("fnctl F_SETFL failed");
+		kanshi_log(KANSHI_LOG_ERROR, "fnctl F_SETFL failed: %s",
+			strerror(errno));
 		return -1;
 	}
 	flags = fcntl(fd, F_GETFD);
 	if (flags == -1) {
-		perror("fnctl F_GETFD failed");
+		kanshi_log(KANSHI_LOG_ERROR, "fnctl F_GETFD failed: %s",
+			strerror(errno));
 		return -1;
 	}
 	flags |= O_CLOEXEC;
 	if (fcntl(fd, F_SETFD, flags) == -1) {
-		perror("fnctl F_SETFD failed");
+		kanshi_log(KANSHI_LOG_ERROR, "fnctl F_SETFD failed: %s",
+			strerror(errno));
 		return -1;
 	}
 	return 0;
@@ -46,18 +51,79 @@ static void signal_handler(int signum) {
 	}
 }
 
+// Returns false if the connection to the compositor is broken
+static bool prepare_read(struct wl_display *display) {
+	while (wl_display_prepare_read(display) != 0) {
+		if (wl_display_dispatch_pending(display) == -1) {
+			return false;
+		}
+	}
+
+	int ret;
+	while (true) {
+		ret = wl_display_flush(display);
+		if (ret != -1 || errno != EAGAIN) {
+			break;
+		}
+	}
+	if (ret < 0 && errno != EPIPE) {
+		wl_display_cancel_read(display);
+		return false;
+	}
+	return true;
+}
+
 enum readfds_type {
-	FD_WAYLAND,
 	FD_SIGNAL,
-#if KANSHI_HAS_VARLINK
-	FD_VARLINK,
-#endif
+	FD_RELOAD,
+	FD_METRICS,
 	FD_COUNT,
 };
 
-int kanshi_main_loop(struct kanshi_state *state) {
+// Polled for each display, after the ones above
+enum state_readfds_type {
+	FD_WAYLAND,
+	FD_IPC,
+	FD_TIMER,
+	FD_STATE_COUNT,
+};
+
+// Returns false if the loop should stop
+static bool handle_display_error(struct kanshi_state *state) {
+	if (!state->reconnect) {
+		return false;
+	}
+	kanshi_handle_disconnect(state);
+	return true;
+}
+
+// Returns false if the loop should stop
+static bool dispatch_state(struct kanshi_state *state, struct pollfd *fds) {
+	if (fds[FD_IPC].revents & POLLIN) {
+		if (kanshi_ipc_dispatch(state) != 0) {
+			return false;
+		}
+	}
+
+	if (fds[FD_TIMER].revents & POLLIN) {
+		uint64_t expirations;
+		ssize_t s = read(fds[FD_TIMER].fd, &expirations, sizeof(expirations));
+		if (s < 0 && errno != EAGAIN) {
+			kanshi_log(KANSHI_LOG_ERROR, "read from timerfd failed: %s",
+				strerror(errno));
+			return false;
+		}
+		if (s == sizeof(expirations)) {
+			kanshi_handle_timer(state);
+		}
+	}
+	return true;
+}
+
+int kanshi_main_loop(struct kanshi_daemon *daemon) {
 	if (pipe(signal_pipefds) == -1) {
-		perror("read from signalfd failed");
+		kanshi_log(KANSHI_LOG_ERROR, "read from signalfd failed: %s",
+			strerror(errno));
 		return EXIT_FAILURE;
 	}
 	if (set_pipe_flags(signal_pipefds[0]) == -1) {
@@ -75,59 +141,111 @@ int kanshi_main_loop(struct kanshi_state *state) {
 	sigaction(SIGQUIT, &action, NULL);
 	sigaction(SIGTERM, &action, NULL);
 	sigaction(SIGHUP, &action, NULL);
+	sigaction(SIGUSR1, &action, NULL);
 
-	struct pollfd readfds[FD_COUNT] = {0};
-	readfds[FD_WAYLAND].fd = wl_display_get_fd(state->display);
-	readfds[FD_WAYLAND].events = POLLIN;
+	size_t states_len = wl_list_length(&daemon->states);
+	size_t readfds_len = FD_COUNT + states_len * FD_STATE_COUNT;
+	struct pollfd *readfds = calloc(readfds_len, sizeof(*readfds));
+	// The display whose events are being read, and whether it failed
+	struct wl_display **displays = calloc(states_len, sizeof(*displays));
+	bool *broken = calloc(states_len, sizeof(*broken));
+	if (readfds == NULL || displays == NULL || broken == NULL) {
+		kanshi_log(KANSHI_LOG_ERROR, "failed to allocate poll state");
+		free(readfds);
+		free(displays);
+		free(broken);
+		return EXIT_FAILURE;
+	}
 	readfds[FD_SIGNAL].fd = signal_pipefds[0];
 	readfds[FD_SIGNAL].events = POLLIN;
-#if KANSHI_HAS_VARLINK
-	readfds[FD_VARLINK].fd = varlink_service_get_fd(state->service);
-	readfds[FD_VARLINK].events = POLLIN;
-#endif
-
-	while (state->running) {
-		while (wl_display_prepare_read(state->display) != 0) {
-			if (wl_display_dispatch_pending(state->display) == -1) {
-				return EXIT_FAILURE;
+	readfds[FD_RELOAD].fd = daemon->reload_fds[0];
+	readfds[FD_RELOAD].events = POLLIN;
+	readfds[FD_METRICS].fd = daemon->metrics_fd;
+	readfds[FD_METRICS].events = POLLIN;
+	struct kanshi_state *state;
+	size_t i = 0;
+	wl_list_for_each(state, &daemon->states, link) {
+		struct pollfd *fds = &readfds[FD_COUNT + i * FD_STATE_COUNT];
+		fds[FD_WAYLAND].events = POLLIN;
+		fds[FD_IPC].fd = kanshi_ipc_get_fd(state);
+		fds[FD_IPC].events = POLLIN;
+		fds[FD_TIMER].fd = state->timer_fd;
+		fds[FD_TIMER].events = POLLIN;
+		i++;
+	}
+
+	int ret = EXIT_SUCCESS;
+	while (daemon->running) {
+		// The display is replaced when reconnecting to the compositor
+		bool any_broken = false;
+		i = 0;
+		wl_list_for_each(state, &daemon->states, link) {
+			struct pollfd *fds = &readfds[FD_COUNT + i * FD_STATE_COUNT];
+			displays[i] = state->display;
+			broken[i] = false;
+			fds[FD_WAYLAND].fd = -1;
+			if (displays[i] != NULL && !prepare_read(displays[i])) {
+				displays[i] = NULL;
+				broken[i] = true;
+				any_broken = true;
+			} else if (displays[i] != NULL) {
+				fds[FD_WAYLAND].fd = wl_display_get_fd(displays[i]);
 			}
+			i++;
 		}
 
-		int ret;
-
-		while (true) {
-			ret = wl_display_flush(state->display);
-			if (ret != -1 || errno != EAGAIN) {
-				break;
+		// A broken display is handled right away, without waiting for
+		// other events
+		int n;
+		do {
+			n = poll(readfds, readfds_len, any_broken ? 0 : -1);
+		} while (n == -1 && errno == EINTR);
+		/* will only be -1 if errno wasn't EINTR */
+		if (n == -1) {
+			for (i = 0; i < states_len; i++) {
+				if (displays[i] != NULL) {
+					wl_display_cancel_read(displays[i]);
+				}
 			}
+			ret = EXIT_FAILURE;
+			goto out;
 		}
 
-		if (ret < 0 && errno != EPIPE) {
-			goto read_error;
+		for (i = 0; i < states_len; i++) {
+			if (displays[i] != NULL &&
+					wl_display_read_events(displays[i]) == -1) {
+				broken[i] = true;
+			}
 		}
 
-		do {
-			ret = poll(readfds, sizeof(readfds) / sizeof(readfds[0]), -1);
-		} while (ret == -1 && errno == EINTR);
-		/* will only be -1 if errno wasn't EINTR */
-		if (ret == -1) {
-			goto read_error;
+		i = 0;
+		wl_list_for_each(state, &daemon->states, link) {
+			struct pollfd *fds = &readfds[FD_COUNT + i * FD_STATE_COUNT];
+			if (!dispatch_state(state, fds)) {
+				ret = EXIT_FAILURE;
+				goto out;
+			}
+			i++;
 		}
 
-		if (wl_display_read_events(state->display) == -1) {
-			return EXIT_FAILURE;
+		if (readfds[FD_RELOAD].revents & POLLIN) {
+			char buf[64];
+			while (read(readfds[FD_RELOAD].fd, buf, sizeof(buf)) > 0) {
+				// Only used to wake up the loop
+			}
+			if (!kanshi_handle_reload(daemon)) {
+				ret = EXIT_FAILURE;
+				goto out;
+			}
 		}
 
-#if KANSHI_HAS_VARLINK
-		if (readfds[FD_VARLINK].revents & POLLIN) {
-			long result = varlink_service_process_events(state->service);
-			if (result != 0) {
-				fprintf(stderr, "varlink_service_process_events failed: %s\n",
-						varlink_error_string(-result));
-				return EXIT_FAILURE;
+		if (readfds[FD_METRICS].revents & POLLIN) {
+			uint64_t expirations;
+			if (read(readfds[FD_METRICS].fd, &expirations,
+					sizeof(expirations)) == sizeof(expirations)) {
+				kanshi_metrics_write(daemon);
 			}
 		}
-#endif
 
 		if (readfds[FD_SIGNAL].revents & POLLIN) {
 			for (;;) {
@@ -141,32 +259,48 @@ int kanshi_main_loop(struct kanshi_state *state) {
 					if (errno == EAGAIN) {
 						break;
 					}
-					perror("read from signal pipe failed");
-					return EXIT_FAILURE;
+					kanshi_log(KANSHI_LOG_ERROR, "read from signal pipe failed: %s",
+						strerror(errno));
+					ret = EXIT_FAILURE;
+					goto out;
 				}
 				if (s < (ssize_t) sizeof(signum)) {
-					fprintf(stderr, "read too few bytes from signal pipe\n");
-					return EXIT_FAILURE;
+					kanshi_log(KANSHI_LOG_ERROR, "read too few bytes from signal pipe");
+					ret = EXIT_FAILURE;
+					goto out;
 				}
 				switch (signum) {
 				case SIGHUP:
-					kanshi_reload_config(state);
+					kanshi_reload_config(daemon);
+					break;
+				case SIGUSR1:
+					kanshi_log_dump(stderr);
 					break;
 				default:
 					/* exiting after signal considered successful */
-					return EXIT_SUCCESS;
+					goto out;
 				}
 			}
 		}
 
-		if (wl_display_dispatch_pending(state->display) == -1) {
-			return EXIT_FAILURE;
+		i = 0;
+		wl_list_for_each(state, &daemon->states, link) {
+			if (!broken[i] && displays[i] != NULL &&
+					displays[i] == state->display &&
+					wl_display_dispatch_pending(displays[i]) == -1) {
+				broken[i] = true;
+			}
+			if (broken[i] && !handle_display_error(state)) {
+				ret = EXIT_FAILURE;
+				goto out;
+			}
+			i++;
 		}
 	}
 
-	return EXIT_SUCCESS;
-
-read_error:
-	wl_display_cancel_read(state->display);
-	return EXIT_FAILURE;
+out:
+	free(readfds);
+	free(displays);
+	free(broken);
+	return ret;
 }
@@ -2,6 +2,7 @@
 #define KANSHI_CONFIG_H
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <wayland-client.h>
 
 enum kanshi_output_field {
@@ -10,23 +11,43 @@ enum kanshi_output_field {
 	KANSHI_OUTPUT_POSITION = 1 << 2,
 	KANSHI_OUTPUT_SCALE = 1 << 3,
 	KANSHI_OUTPUT_TRANSFORM = 1 << 4,
+	KANSHI_OUTPUT_ADAPTIVE_SYNC = 1 << 5,
 };
 
-struct kanshi_profile_output {
-	char *name;
+enum kanshi_mode_policy {
+	KANSHI_MODE_EXACT,
+	KANSHI_MODE_PREFERRED,
+	KANSHI_MODE_HIGHEST_REFRESH,
+	KANSHI_MODE_HIGHEST_RESOLUTION,
+};
+
+struct kanshi_output_settings {
 	unsigned int fields; // enum kanshi_output_field
-	struct wl_list link;
 
 	bool enabled;
 	struct {
+		// Keywords are resolved against the modes of the output
+		enum kanshi_mode_policy policy;
+		// For KANSHI_MODE_EXACT
 		int width, height;
 		int refresh; // mHz
+		bool custom; // allowed even if not advertised
 	} mode;
 	struct {
 		int x, y;
 	} position;
 	float scale;
 	enum wl_output_transform transform;
+	bool adaptive_sync;
+};
+
+struct kanshi_profile_output {
+	char *name;
+	uint32_t name_hash; // see hash_criteria()
+	struct wl_list link;
+	// Shared with a template unless owned
+	struct kanshi_output_settings *settings;
+	bool owns_settings;
 };
 
 struct kanshi_profile_command {
@@ -40,10 +61,22 @@ struct kanshi_profile {
 	// Wildcard outputs are stored at the end of the list
 	struct wl_list outputs;
 	struct wl_list commands;
+	// Matches even if some connected outputs aren't listed
+	bool partial;
+};
+
+// Output settings which can be referred to by name
+struct kanshi_output_template {
+	struct wl_list link;
+	char *name;
+	struct kanshi_output_settings settings;
 };
 
 struct kanshi_config {
 	struct wl_list profiles;
+	// Profiles which are never applied, only used by others
+	struct wl_list profile_templates; // kanshi_profile.link
+	struct wl_list output_templates; // kanshi_output_template.link
 };
 
 #endif
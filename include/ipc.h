@@ -7,7 +7,19 @@
 
 int kanshi_init_ipc(struct kanshi_state *state);
 void kanshi_free_ipc(struct kanshi_state *state);
+int kanshi_ipc_get_fd(struct kanshi_state *state);
+int kanshi_ipc_dispatch(struct kanshi_state *state);
+void kanshi_ipc_send_event(struct kanshi_state *state,
+	enum kanshi_event_type type, const char *profile, const char *output);
+void kanshi_ipc_reload_done(struct kanshi_state *state, bool ok,
+	enum kanshi_apply_result result);
+void kanshi_ipc_transaction_done(struct kanshi_state *state,
+	uint32_t transaction, enum kanshi_event_type type, const char *profile);
+void kanshi_ipc_apply_done(struct kanshi_state *state,
+	enum kanshi_apply_result result);
 
-int get_ipc_address(char *address, size_t size);
+int get_ipc_address(char *address, size_t size, const char *display);
+const char *kanshi_event_type_str(enum kanshi_event_type type);
+const char *kanshi_transform_str(enum wl_output_transform transform);
 
 #endif
@@ -2,12 +2,62 @@
 #define KANSHI_KANSHI_H
 
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
 #include <wayland-client.h>
 
+#define HEADS_MAX 64
+
 struct zwlr_output_manager_v1;
+struct kanshi_config;
+struct kanshi_profile;
+struct kanshi_profile_output;
+struct kanshi_output_settings;
 
+struct kanshi_daemon;
 struct kanshi_state;
 struct kanshi_head;
+struct kanshi_reload;
+
+enum kanshi_event_type {
+	KANSHI_EVENT_HEAD_ADDED,
+	KANSHI_EVENT_HEAD_REMOVED,
+	KANSHI_EVENT_PROFILE_MATCHED,
+	// The profile couldn't be applied, the next matching one is tried
+	KANSHI_EVENT_PROFILE_SKIPPED,
+	KANSHI_EVENT_APPLY_STARTED,
+	KANSHI_EVENT_APPLY_SUCCEEDED,
+	KANSHI_EVENT_APPLY_FAILED,
+	KANSHI_EVENT_APPLY_CANCELLED,
+	// The configuration was cancelled and will be sent again
+	KANSHI_EVENT_APPLY_RETRYING,
+	KANSHI_EVENT_TEST_SUCCEEDED,
+	KANSHI_EVENT_TEST_FAILED,
+	KANSHI_EVENT_TEST_CANCELLED,
+	KANSHI_EVENT_RELOAD_DONE,
+};
+
+#define KANSHI_EVENT_COUNT (KANSHI_EVENT_RELOAD_DONE + 1)
+
+enum kanshi_timer_type {
+	KANSHI_TIMER_NONE,
+	// The compositor didn't answer the transaction in time
+	KANSHI_TIMER_TIMEOUT,
+	// A cancelled configuration is due for another attempt
+	KANSHI_TIMER_RETRY,
+	// The connection to the compositor was lost, time to try again
+	KANSHI_TIMER_RECONNECT,
+};
+
+enum kanshi_apply_result {
+	// A configuration has been sent, its outcome will be reported by an event
+	KANSHI_APPLY_PENDING,
+	// The profile is already applied or pending
+	KANSHI_APPLY_UNCHANGED,
+	KANSHI_APPLY_NO_MATCH,
+	KANSHI_APPLY_FAILED,
+};
 
 struct kanshi_mode {
 	struct kanshi_head *head;
@@ -25,11 +75,16 @@ struct kanshi_head {
 	struct wl_list link;
 
 	char *name, *description;
+	char *make, *model, *serial_number;
+	// "Make Model Serial", NULL if the compositor doesn't advertise them
+	char *identifier;
+	uint32_t identifier_hash;
 	int32_t phys_width, phys_height; // mm
 	struct wl_list modes;
 
 	bool enabled;
 	struct kanshi_mode *mode;
+	// Set by kanshi, until the compositor reports another current mode
 	struct {
 		int32_t width, height;
 		int32_t refresh;
@@ -37,32 +92,170 @@ struct kanshi_head {
 	int32_t x, y;
 	enum wl_output_transform transform;
 	double scale;
+	bool adaptive_sync;
+
+	bool announced; // a head added event has been sent
 };
 
-struct kanshi_state {
+struct kanshi_candidate {
+	struct kanshi_profile *profile;
+	struct kanshi_profile_output *matches[HEADS_MAX];
+	// Sum of the matched criteria specificities, see --best-match
+	unsigned int specificity;
+};
+
+#define KANSHI_HISTOGRAM_BUCKETS 7
+
+// Durations in seconds, see metrics.c for the bucket bounds
+struct kanshi_histogram {
+	uint64_t buckets[KANSHI_HISTOGRAM_BUCKETS]; // not cumulative
+	uint64_t count;
+	double sum;
+};
+
+enum kanshi_duration_type {
+	// Matching the profiles against the connected heads
+	KANSHI_DURATION_MATCH,
+	// From sending a configuration to the compositor's answer
+	KANSHI_DURATION_TRANSACTION,
+	// Spawning a profile command, until it is executed
+	KANSHI_DURATION_EXEC,
+	KANSHI_DURATION_COUNT,
+};
+
+struct kanshi_metrics {
+	uint64_t events[KANSHI_EVENT_COUNT];
+	uint64_t exec_failures;
+	struct kanshi_histogram durations[KANSHI_DURATION_COUNT];
+};
+
+// Shared by the connections to all the displays kanshi manages
+struct kanshi_daemon {
 	bool running;
-	struct wl_display *display;
+	struct wl_list states; // kanshi_state.link
+
+	struct kanshi_config *config;
+	const char *config_arg;
+	// The config being parsed in the background, NULL if none
+	struct kanshi_reload *reload;
+	bool reload_again; // requested again while parsing
+	int reload_fds[2]; // written to once the config is parsed
+
+	// Node exporter textfile, written every metrics_interval seconds
+	const char *metrics_path;
+	int metrics_interval;
+	int metrics_fd; // timerfd, -1 if disabled
+};
+
+// The connection to a display, with its outputs and transactions
+struct kanshi_state {
+	struct kanshi_daemon *daemon;
+	struct wl_list link;
+
+	const char *display_name; // NULL for $WAYLAND_DISPLAY
+	struct wl_display *display; // NULL while reconnecting
+	struct wl_registry *registry;
 	struct zwlr_output_manager_v1 *output_manager;
 #if KANSHI_HAS_VARLINK
 	struct VarlinkService *service;
+#else
+	struct kanshi_ipc_server *ipc_server;
 #endif
+	struct wl_list monitors; // kanshi_ipc_call.link
+	struct wl_list pending_calls; // kanshi_ipc_call.link
+	struct wl_list test_calls; // kanshi_ipc_call.link
+	struct wl_list reload_calls; // kanshi_ipc_call.link
+	struct kanshi_trace *trace;
 
-	struct kanshi_config *config;
-	const char *config_arg;
+	// Profile applied on request, until the next hotplug
+	struct kanshi_config *override_config;
+	bool override_keep; // across reloads
+	// Test configurations before applying them
+	bool test_first;
+	// Prefer the most specific matching profile over the first one
+	bool best_match;
+	// Save the layouts which got applied, and restore them on startup
+	bool restore;
+	// The saved layout applied on startup, before the config is loaded
+	struct kanshi_config *restored_config;
+	bool restore_attempted; // even if no layout was saved
+	// Connect again when the compositor goes away, instead of exiting
+	bool reconnect;
+	int reconnect_delay; // ms, before the next attempt
+	// Only test the matching profile, then exit
+	bool dry_run;
+	bool dry_run_accepted;
 
 	struct wl_list heads;
+	bool heads_changed; // since profiles were last matched
 	uint32_t serial;
 	struct kanshi_profile *current_profile;
-	struct kanshi_profile *pending_profile;
+	struct kanshi_profile *pending_profile; // the transaction's
+	struct wl_list pending_profiles; // kanshi_pending_profile.link
+
+	// The configuration being applied, at most one at a time
+	struct kanshi_pending_profile *transaction;
+	uint32_t transactions; // started so far, the last one's id
+	// The outputs or the requested profile changed while the transaction
+	// was in flight, a profile is picked again once it's done
+	bool superseded;
+	// Profile applied on request, NULL when matching profiles automatically
+	struct kanshi_profile *requested_profile;
+	struct timespec transaction_start;
+	int retries; // after the transaction was cancelled
+	int timer_fd;
+	enum kanshi_timer_type timer;
+
+	// Profiles matching the heads at candidates_serial, best first
+	struct kanshi_candidate *candidates;
+	size_t candidates_len, candidates_cap;
+	size_t next_candidate; // tried next if the current one fails
+	uint32_t candidates_serial;
+
+	struct kanshi_metrics metrics;
+};
+
+enum kanshi_pending_type {
+	KANSHI_PENDING_APPLY,
+	// Applied once the compositor has accepted the test
+	KANSHI_PENDING_TEST_FIRST,
+	KANSHI_PENDING_TEST_ONLY,
 };
 
 struct kanshi_pending_profile {
 	struct kanshi_state *state;
-	struct kanshi_profile *profile;
+	struct kanshi_profile *profile; // NULL if destroyed since
+	struct wl_list link;
+
+	enum kanshi_pending_type type;
+	struct zwlr_output_configuration_v1 *config;
+	uint32_t serial;
+	uint32_t id; // of the transaction, 0 until it's started
+	struct kanshi_profile_output *matches[HEADS_MAX];
 };
 
-bool kanshi_reload_config(struct kanshi_state *state);
+bool kanshi_reload_config(struct kanshi_daemon *daemon);
+bool kanshi_handle_reload(struct kanshi_daemon *daemon);
+enum kanshi_apply_result kanshi_switch_profile(struct kanshi_state *state,
+	struct kanshi_profile *profile);
+enum kanshi_apply_result kanshi_apply_override(struct kanshi_state *state,
+	struct kanshi_config *config, bool keep);
+// The transaction whose outcome answers a request which returned
+// KANSHI_APPLY_PENDING
+uint32_t kanshi_awaited_transaction(struct kanshi_state *state);
+bool kanshi_match_profile(struct kanshi_state *state,
+	struct kanshi_profile *profile,
+	struct kanshi_profile_output *matches[static HEADS_MAX]);
+enum kanshi_apply_result kanshi_test_profile(struct kanshi_state *state,
+	struct kanshi_profile *profile);
+bool kanshi_describe_profile(struct kanshi_state *state,
+	struct kanshi_profile *profile, FILE *f);
+struct kanshi_mode *kanshi_select_mode(struct kanshi_head *head,
+	const struct kanshi_output_settings *settings);
+
+void kanshi_handle_timer(struct kanshi_state *state);
+void kanshi_handle_disconnect(struct kanshi_state *state);
 
-int kanshi_main_loop(struct kanshi_state *state);
+int kanshi_main_loop(struct kanshi_daemon *daemon);
 
 #endif
@@ -0,0 +1,16 @@
+#ifndef KANSHI_LAYOUT_H
+#define KANSHI_LAYOUT_H
+
+#include <stdbool.h>
+
+#include "kanshi.h"
+
+bool kanshi_save_layout(struct kanshi_state *state,
+	struct kanshi_profile *profile,
+	struct kanshi_profile_output **matches);
+struct kanshi_config *kanshi_load_layout(struct kanshi_state *state);
+// Returns true if both matches resolve to the same settings for all the heads
+bool kanshi_same_layout(struct kanshi_state *state,
+	struct kanshi_profile_output **a, struct kanshi_profile_output **b);
+
+#endif
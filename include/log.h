@@ -0,0 +1,34 @@
+#ifndef KANSHI_LOG_H
+#define KANSHI_LOG_H
+
+#include <stdbool.h>
+#include <stdio.h>
+
+enum kanshi_log_level {
+	KANSHI_LOG_SILENT,
+	KANSHI_LOG_ERROR,
+	KANSHI_LOG_INFO,
+	KANSHI_LOG_DEBUG,
+};
+
+// Messages are only formatted if they are printed or kept in the history
+#define kanshi_log(level, ...) \
+	do { \
+		if (kanshi_log_enabled(level)) { \
+			kanshi_log_write(level, __FILE__, __LINE__, __VA_ARGS__); \
+		} \
+	} while (0)
+
+bool kanshi_log_init(enum kanshi_log_level level,
+	enum kanshi_log_level history_level, int history_len);
+void kanshi_log_finish(void);
+bool kanshi_log_enabled(enum kanshi_log_level level);
+void kanshi_log_write(enum kanshi_log_level level, const char *file, int line,
+	const char *fmt, ...) __attribute__((format(printf, 4, 5)));
+// Writes the history of recent messages, oldest first
+void kanshi_log_dump(FILE *f);
+
+const char *kanshi_log_level_str(enum kanshi_log_level level);
+bool kanshi_log_parse_level(const char *str, enum kanshi_log_level *out);
+
+#endif
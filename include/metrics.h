@@ -0,0 +1,14 @@
+#ifndef KANSHI_METRICS_H
+#define KANSHI_METRICS_H
+
+#include <stdbool.h>
+#include <time.h>
+
+#include "kanshi.h"
+
+void kanshi_metrics_observe(struct kanshi_state *state,
+	enum kanshi_duration_type type, const struct timespec *start);
+bool kanshi_metrics_start(struct kanshi_daemon *daemon);
+bool kanshi_metrics_write(struct kanshi_daemon *daemon);
+
+#endif
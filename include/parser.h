@@ -1,6 +1,7 @@
 #ifndef KANSHI_PARSER_H
 #define KANSHI_PARSER_H
 
+#include <stdint.h>
 #include <stdio.h>
 
 struct kanshi_config;
@@ -23,5 +24,9 @@ struct kanshi_parser {
 };
 
 struct kanshi_config *parse_config(const char *path);
+struct kanshi_config *parse_config_str(const char *str);
+struct kanshi_config *parse_override_str(const char *str);
+void destroy_config(struct kanshi_config *config);
+uint32_t hash_criteria(const char *str);
 
 #endif
@@ -0,0 +1,24 @@
+#ifndef KANSHI_PROBES_H
+#define KANSHI_PROBES_H
+
+// USDT probes, to be attached to with e.g. bpftrace:
+//
+//   bpftrace -e 'usdt:/usr/bin/kanshi:kanshi:apply_profile
+//     { printf("%s\n", str(arg0)); }'
+//
+// Unless built with -Dusdt=enabled, they expand to nothing and their
+// arguments aren't evaluated.
+
+#if KANSHI_HAS_USDT
+#include <sys/sdt.h>
+
+#define KANSHI_PROBE1(name, a) DTRACE_PROBE1(kanshi, name, a)
+#define KANSHI_PROBE2(name, a, b) DTRACE_PROBE2(kanshi, name, a, b)
+#define KANSHI_PROBE3(name, a, b, c) DTRACE_PROBE3(kanshi, name, a, b, c)
+#else
+#define KANSHI_PROBE1(name, a) do {} while (0)
+#define KANSHI_PROBE2(name, a, b) do {} while (0)
+#define KANSHI_PROBE3(name, a, b, c) do {} while (0)
+#endif
+
+#endif
@@ -0,0 +1,29 @@
+#ifndef KANSHI_TRACE_H
+#define KANSHI_TRACE_H
+
+#include <stdbool.h>
+#include <wayland-client.h>
+
+#include "kanshi.h"
+
+struct zwlr_output_configuration_v1;
+
+struct kanshi_trace;
+
+bool kanshi_trace_open(struct kanshi_state *state, const char *path);
+void kanshi_trace_close(struct kanshi_state *state);
+void kanshi_trace_event(struct kanshi_state *state, void *proxy,
+	const char *fmt, ...) __attribute__((format(printf, 3, 4)));
+void kanshi_trace_configuration(struct kanshi_state *state,
+	struct zwlr_output_configuration_v1 *config,
+	struct kanshi_profile *profile, bool test);
+void kanshi_trace_reload(struct kanshi_state *state);
+bool kanshi_trace_is_replay(struct kanshi_state *state);
+
+struct wl_display *kanshi_replay_connect(struct kanshi_state *state);
+void kanshi_replay_set_timer(struct kanshi_state *state, int msec);
+// Replays the trace loops times, failing if memory grows after a warm-up
+int kanshi_replay(struct kanshi_state *state, struct wl_registry *registry,
+	const char *path, int loops);
+
+#endif
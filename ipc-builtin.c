@@ -0,0 +1,983 @@
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "ipc.h"
+#include "kanshi.h"
+#include "log.h"
+#include "parser.h"
+
+// Built-in control socket, used when kanshi is built without libvarlink.
+//
+// A client connects and sends a single request line. The server replies with
+// a status line ("ok" or "error") followed by text meant to be shown as-is,
+// then closes the connection. Monitor connections stay open and receive one
+// line per event.
+//
+// Apply requests are followed by the config text to apply, whose length in
+// bytes ends the request line: "apply [--keep] <length>".
+//
+// Connections are non-blocking and polled through a single epoll fd, like
+// libvarlink's, so that a slow client never stalls the event loop: requests
+// are read and replies are written as the socket allows.
+
+#define REQUEST_MAX 512
+#define BODY_MAX (64 * 1024)
+// A client which doesn't read its replies is disconnected past this
+#define OUTPUT_MAX (1024 * 1024)
+
+struct kanshi_ipc_server {
+	int fd;
+	int epoll_fd;
+	struct sockaddr_un addr;
+	// Connections waiting for their request, or for their reply to be sent
+	struct wl_list clients; // kanshi_ipc_call.link
+};
+
+struct kanshi_ipc_call {
+	int fd;
+	struct kanshi_ipc_server *server;
+	struct wl_list link;
+	uint32_t events; // polled
+
+	char request[REQUEST_MAX];
+	size_t request_len;
+	// Only set for apply calls, read after the request line
+	char *body;
+	size_t body_len, body_size;
+	bool keep;
+	bool handled; // the request has been read
+
+	char *out; // not sent yet
+	size_t out_len;
+	bool failed; // the connection is broken
+	bool closing; // once the output is sent
+
+	// Answered by the outcome of this transaction, or a later one if it
+	// doesn't get to the end, only set for pending calls
+	uint32_t transaction;
+	// Only set for test calls
+	char *profile, *plan;
+};
+
+static int set_fd_flags(int fd) {
+	int flags = fcntl(fd, F_GETFL);
+	if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+		kanshi_log(KANSHI_LOG_ERROR, "fcntl F_SETFL failed: %s",
+			strerror(errno));
+		return -1;
+	}
+	flags = fcntl(fd, F_GETFD);
+	if (flags == -1 || fcntl(fd, F_SETFD, flags | FD_CLOEXEC) == -1) {
+		kanshi_log(KANSHI_LOG_ERROR, "fcntl F_SETFD failed: %s",
+			strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+static void destroy_call(struct kanshi_ipc_call *call) {
+	wl_list_remove(&call->link);
+	epoll_ctl(call->server->epoll_fd, EPOLL_CTL_DEL, call->fd, NULL);
+	close(call->fd);
+	free(call->out);
+	free(call->body);
+	free(call->profile);
+	free(call->plan);
+	free(call);
+}
+
+static void update_events(struct kanshi_ipc_call *call) {
+	uint32_t events = EPOLLIN | (call->out_len > 0 ? EPOLLOUT : 0);
+	if (events == call->events) {
+		return;
+	}
+	struct epoll_event event = { .events = events, .data.ptr = call };
+	if (epoll_ctl(call->server->epoll_fd, EPOLL_CTL_MOD, call->fd,
+			&event) != 0) {
+		call->failed = true;
+		return;
+	}
+	call->events = events;
+}
+
+static void flush_call(struct kanshi_ipc_call *call) {
+	size_t sent = 0;
+	while (sent < call->out_len) {
+		ssize_t n = send(call->fd, call->out + sent, call->out_len - sent,
+			MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno != EAGAIN) {
+				call->failed = true;
+				return;
+			}
+			break;
+		}
+		sent += n;
+	}
+	if (sent > 0) {
+		memmove(call->out, call->out + sent, call->out_len - sent);
+		call->out_len -= sent;
+	}
+	update_events(call);
+}
+
+// Queues data to be sent as the socket allows, returns false if the
+// connection is broken
+static bool send_all(struct kanshi_ipc_call *call, const char *buf,
+		size_t len) {
+	if (call->failed) {
+		return false;
+	}
+	if (call->out_len + len > OUTPUT_MAX) {
+		call->failed = true;
+		return false;
+	}
+	char *out = realloc(call->out, call->out_len + len);
+	if (out == NULL && call->out_len + len > 0) {
+		call->failed = true;
+		return false;
+	}
+	call->out = out;
+	memcpy(call->out + call->out_len, buf, len);
+	call->out_len += len;
+	flush_call(call);
+	return !call->failed;
+}
+
+static bool send_reply(struct kanshi_ipc_call *call, bool ok,
+	const char *fmt, ...) __attribute__((format(printf, 3, 4)));
+
+static bool send_reply(struct kanshi_ipc_call *call, bool ok,
+		const char *fmt, ...) {
+	char buf[1024];
+	int len = snprintf(buf, sizeof(buf), "%s\n", ok ? "ok" : "error");
+	va_list args;
+	va_start(args, fmt);
+	int n = vsnprintf(buf + len, sizeof(buf) - len, fmt, args);
+	va_end(args);
+	if (n < 0) {
+		return false;
+	}
+	len += n;
+	if ((size_t)len >= sizeof(buf)) {
+		len = sizeof(buf) - 1;
+	}
+	return send_all(call, buf, len);
+}
+
+static void move_call(struct kanshi_ipc_call *call, struct wl_list *list) {
+	wl_list_remove(&call->link);
+	wl_list_insert(list->prev, &call->link);
+}
+
+// The connection is closed once the reply has been sent
+static void finish_call(struct kanshi_ipc_call *call) {
+	if (call->failed || call->out_len == 0) {
+		destroy_call(call);
+		return;
+	}
+	call->closing = true;
+	move_call(call, &call->server->clients);
+}
+
+// The profile is NULL if it was destroyed by a reload meanwhile
+static void send_apply_result(struct kanshi_ipc_call *call,
+		const char *profile, const char *result) {
+	if (strcmp(result, "no-match") == 0) {
+		send_reply(call, true, "No profile matched\n");
+	} else if (profile == NULL) {
+		if (strcmp(result, "succeeded") == 0 ||
+				strcmp(result, "unchanged") == 0) {
+			send_reply(call, true, "Configuration applied\n");
+		} else {
+			send_reply(call, false, "Failed to apply configuration: %s\n",
+				result);
+		}
+	} else if (strcmp(result, "succeeded") == 0) {
+		send_reply(call, true, "Profile '%s' applied\n", profile);
+	} else if (strcmp(result, "unchanged") == 0) {
+		send_reply(call, true, "Profile '%s' already applied\n", profile);
+	} else {
+		send_reply(call, false, "Failed to apply profile '%s': %s\n",
+			profile, result);
+	}
+}
+
+static void send_test_result(struct kanshi_ipc_call *call,
+		const char *profile, const char *result, const char *plan) {
+	if (strcmp(result, "no-match") == 0) {
+		send_reply(call, false, "Profile '%s' doesn't match the connected "
+			"outputs\n", profile);
+		return;
+	}
+
+	bool ok = strcmp(result, "succeeded") == 0;
+	const char *status = ok ? "ok\n" : "error\n";
+	char outcome[512];
+	snprintf(outcome, sizeof(outcome), "Profile '%s' %s\n", profile,
+		ok ? "accepted by the compositor" :
+		strcmp(result, "cancelled") == 0 ? "test cancelled" :
+		"rejected by the compositor");
+	// The plan has one line per output and can be long
+	if (send_all(call, status, strlen(status)) &&
+			send_all(call, plan, strlen(plan))) {
+		send_all(call, outcome, strlen(outcome));
+	}
+}
+
+void kanshi_ipc_send_event(struct kanshi_state *state,
+		enum kanshi_event_type type, const char *profile, const char *output) {
+	if (state->ipc_server == NULL) {
+		return;
+	}
+
+	struct kanshi_ipc_call *call, *tmp;
+	if (!wl_list_empty(&state->monitors)) {
+		char buf[512];
+		int len = snprintf(buf, sizeof(buf), "%s", kanshi_event_type_str(type));
+		if (profile != NULL && len < (int)sizeof(buf)) {
+			len += snprintf(buf + len, sizeof(buf) - len,
+				" profile=\"%s\"", profile);
+		}
+		if (output != NULL && len < (int)sizeof(buf)) {
+			len += snprintf(buf + len, sizeof(buf) - len,
+				" output=\"%s\"", output);
+		}
+		if (len >= (int)sizeof(buf)) {
+			len = sizeof(buf) - 2;
+		}
+		buf[len++] = '\n';
+
+		wl_list_for_each_safe(call, tmp, &state->monitors, link) {
+			if (!send_all(call, buf, len)) {
+				destroy_call(call);
+			}
+		}
+	}
+
+	switch (type) {
+	case KANSHI_EVENT_TEST_SUCCEEDED:
+	case KANSHI_EVENT_TEST_FAILED:
+	case KANSHI_EVENT_TEST_CANCELLED:;
+		// Any test of the profile answers the calls waiting for it
+		const char *result = type == KANSHI_EVENT_TEST_SUCCEEDED ?
+			"succeeded" : type == KANSHI_EVENT_TEST_FAILED ?
+			"failed" : "cancelled";
+		wl_list_for_each_safe(call, tmp, &state->test_calls, link) {
+			if (strcmp(call->profile, profile) == 0) {
+				send_test_result(call, profile, result, call->plan);
+				finish_call(call);
+			}
+		}
+		break;
+	default:
+		break;
+	}
+}
+
+void kanshi_ipc_transaction_done(struct kanshi_state *state,
+		uint32_t transaction, enum kanshi_event_type type, const char *profile) {
+	if (state->ipc_server == NULL || transaction == 0) {
+		return;
+	}
+	const char *result = type == KANSHI_EVENT_APPLY_SUCCEEDED ? "succeeded" :
+		type == KANSHI_EVENT_APPLY_FAILED ? "failed" : "cancelled";
+	struct kanshi_ipc_call *call, *tmp;
+	wl_list_for_each_safe(call, tmp, &state->pending_calls, link) {
+		if (call->transaction <= transaction) {
+			send_apply_result(call, profile, result);
+			finish_call(call);
+		}
+	}
+}
+
+// Returns true if the connection has been handed over to a call list
+static bool handle_apply_result(struct kanshi_state *state,
+		struct kanshi_ipc_call *call, enum kanshi_apply_result result) {
+	switch (result) {
+	case KANSHI_APPLY_PENDING:
+		// Reply once the compositor has answered
+		call->transaction = kanshi_awaited_transaction(state);
+		move_call(call, &state->pending_calls);
+		return true;
+	case KANSHI_APPLY_UNCHANGED:
+		send_apply_result(call, state->current_profile ?
+			state->current_profile->name : NULL, "unchanged");
+		return false;
+	case KANSHI_APPLY_NO_MATCH:
+		send_apply_result(call, NULL, "no-match");
+		return false;
+	case KANSHI_APPLY_FAILED:
+		send_apply_result(call, NULL, "failed");
+		return false;
+	}
+	abort();
+}
+
+// Picking a profile again didn't send a configuration, the calls waiting for
+// one won't get any
+void kanshi_ipc_apply_done(struct kanshi_state *state,
+		enum kanshi_apply_result result) {
+	if (state->ipc_server == NULL || result == KANSHI_APPLY_PENDING ||
+			state->transaction != NULL) {
+		return;
+	}
+	struct kanshi_ipc_call *call, *tmp;
+	wl_list_for_each_safe(call, tmp, &state->pending_calls, link) {
+		handle_apply_result(state, call, result);
+		finish_call(call);
+	}
+}
+
+void kanshi_ipc_reload_done(struct kanshi_state *state, bool ok,
+		enum kanshi_apply_result result) {
+	if (state->ipc_server == NULL) {
+		return;
+	}
+	struct kanshi_ipc_call *call, *tmp;
+	wl_list_for_each_safe(call, tmp, &state->reload_calls, link) {
+		if (!ok) {
+			send_reply(call, false, "Error: invalid configuration\n");
+		} else if (handle_apply_result(state, call, result)) {
+			continue;
+		}
+		finish_call(call);
+	}
+}
+
+static bool handle_reload(struct kanshi_state *state,
+		struct kanshi_ipc_call *call) {
+	if (!kanshi_reload_config(state->daemon)) {
+		send_reply(call, false, "Error: failed to reload the config\n");
+		return false;
+	}
+	// Reply once the config is parsed
+	move_call(call, &state->reload_calls);
+	return true;
+}
+
+static struct kanshi_profile *find_profile(struct kanshi_state *state,
+		const char *name) {
+	struct kanshi_profile *profile;
+	wl_list_for_each(profile, &state->daemon->config->profiles, link) {
+		if (strcmp(profile->name, name) == 0) {
+			return profile;
+		}
+	}
+	return NULL;
+}
+
+static bool handle_switch(struct kanshi_state *state,
+		struct kanshi_ipc_call *call, const char *name) {
+	if (state->daemon->config == NULL) {
+		send_reply(call, false, "Error: config not loaded yet\n");
+		return false;
+	}
+	struct kanshi_profile *profile = find_profile(state, name);
+	if (profile == NULL) {
+		send_reply(call, false, "Error: profile not found\n");
+		return false;
+	}
+	return handle_apply_result(state, call,
+		kanshi_switch_profile(state, profile));
+}
+
+static bool handle_test(struct kanshi_state *state,
+		struct kanshi_ipc_call *call, const char *name) {
+	if (state->daemon->config == NULL) {
+		send_reply(call, false, "Error: config not loaded yet\n");
+		return false;
+	}
+	struct kanshi_profile *profile = find_profile(state, name);
+	if (profile == NULL) {
+		send_reply(call, false, "Error: profile not found\n");
+		return false;
+	}
+
+	char *plan = NULL;
+	size_t plan_len = 0;
+	FILE *f = open_memstream(&plan, &plan_len);
+	if (f == NULL) {
+		send_reply(call, false, "Error: out of memory\n");
+		return false;
+	}
+	bool matched = kanshi_describe_profile(state, profile, f);
+	if (fclose(f) != 0) {
+		free(plan);
+		send_reply(call, false, "Error: out of memory\n");
+		return false;
+	}
+	if (!matched) {
+		send_test_result(call, name, "no-match", "");
+		free(plan);
+		return false;
+	}
+
+	switch (kanshi_test_profile(state, profile)) {
+	case KANSHI_APPLY_PENDING:
+		// Reply once the compositor has answered
+		call->profile = strdup(name);
+		if (call->profile != NULL) {
+			call->plan = plan;
+			move_call(call, &state->test_calls);
+			return true;
+		}
+		send_reply(call, false, "Error: out of memory\n");
+		break;
+	case KANSHI_APPLY_NO_MATCH:
+		send_test_result(call, name, "no-match", plan);
+		break;
+	default:
+		send_test_result(call, name, "failed", plan);
+		break;
+	}
+	free(plan);
+	return false;
+}
+
+static bool handle_apply(struct kanshi_state *state,
+		struct kanshi_ipc_call *call) {
+	struct kanshi_config *config = parse_override_str(call->body);
+	if (config == NULL) {
+		send_reply(call, false, "Error: invalid configuration\n");
+		return false;
+	}
+	if (wl_list_length(&config->profiles) != 1) {
+		kanshi_log(KANSHI_LOG_ERROR, "expected exactly one profile, got %d",
+			wl_list_length(&config->profiles));
+		destroy_config(config);
+		send_reply(call, false, "Error: invalid configuration\n");
+		return false;
+	}
+	return handle_apply_result(state, call,
+		kanshi_apply_override(state, config, call->keep));
+}
+
+static void write_mode(FILE *f, struct kanshi_mode *mode) {
+	fprintf(f, "%dx%d@%.3fHz", mode->width, mode->height,
+		(double)mode->refresh / 1000);
+}
+
+static void write_head(FILE *f, struct kanshi_head *head,
+		struct kanshi_profile_output *profile_output) {
+	fprintf(f, "\nOutput %s \"%s\"\n", head->name ? head->name : "",
+		head->description ? head->description : "");
+	if (head->identifier != NULL) {
+		fprintf(f, "  Identifier: %s\n", head->identifier);
+	}
+	fprintf(f, "  Enabled: %s\n", head->enabled ? "yes" : "no");
+	if (head->mode != NULL) {
+		fprintf(f, "  Mode: ");
+		write_mode(f, head->mode);
+		fprintf(f, "\n");
+	} else if (head->custom_mode.width > 0) {
+		fprintf(f, "  Mode: %dx%d@%.3fHz (custom)\n", head->custom_mode.width,
+			head->custom_mode.height, (double)head->custom_mode.refresh / 1000);
+	}
+	fprintf(f, "  Position: %d,%d\n", head->x, head->y);
+	fprintf(f, "  Scale: %f\n", head->scale);
+	fprintf(f, "  Transform: %s\n", kanshi_transform_str(head->transform));
+	fprintf(f, "  Adaptive sync: %s\n", head->adaptive_sync ? "yes" : "no");
+	if (profile_output != NULL) {
+		fprintf(f, "  Profile output: %s\n", profile_output->name);
+	}
+	fprintf(f, "  Modes:\n");
+	struct kanshi_mode *mode;
+	wl_list_for_each(mode, &head->modes, link) {
+		fprintf(f, "    ");
+		write_mode(f, mode);
+		fprintf(f, "%s\n", mode->preferred ? " (preferred)" : "");
+	}
+}
+
+static void write_json_string(FILE *f, const char *str) {
+	fputc('"', f);
+	for (const char *p = str; *p != '\0'; p++) {
+		unsigned char c = *p;
+		if (c == '"' || c == '\\') {
+			fprintf(f, "\\%c", c);
+		} else if (c < 0x20) {
+			fprintf(f, "\\u%04x", c);
+		} else {
+			fputc(c, f);
+		}
+	}
+	fputc('"', f);
+}
+
+static void write_mode_json(FILE *f, int width, int height, int refresh,
+		bool preferred, bool custom) {
+	fprintf(f, "{\"width\":%d,\"height\":%d,\"refresh\":%d,"
+		"\"preferred\":%s", width, height, refresh,
+		preferred ? "true" : "false");
+	if (custom) {
+		fprintf(f, ",\"custom\":true");
+	}
+	fputc('}', f);
+}
+
+// Same fields as the varlink Status reply
+static void write_head_json(FILE *f, struct kanshi_head *head,
+		struct kanshi_profile_output *profile_output) {
+	fprintf(f, "{\"name\":");
+	write_json_string(f, head->name ? head->name : "");
+	fprintf(f, ",\"description\":");
+	write_json_string(f, head->description ? head->description : "");
+	if (head->identifier != NULL) {
+		fprintf(f, ",\"identifier\":");
+		write_json_string(f, head->identifier);
+	}
+	fprintf(f, ",\"enabled\":%s", head->enabled ? "true" : "false");
+	if (head->mode != NULL) {
+		fprintf(f, ",\"current_mode\":");
+		write_mode_json(f, head->mode->width, head->mode->height,
+			head->mode->refresh, head->mode->preferred, false);
+	} else if (head->custom_mode.width > 0) {
+		fprintf(f, ",\"current_mode\":");
+		write_mode_json(f, head->custom_mode.width, head->custom_mode.height,
+			head->custom_mode.refresh, false, true);
+	}
+	fprintf(f, ",\"modes\":[");
+	struct kanshi_mode *mode;
+	wl_list_for_each(mode, &head->modes, link) {
+		if (mode->link.prev != &head->modes) {
+			fputc(',', f);
+		}
+		write_mode_json(f, mode->width, mode->height, mode->refresh,
+			mode->preferred, false);
+	}
+	fprintf(f, "],\"x\":%d,\"y\":%d,\"scale\":%f,\"transform\":",
+		head->x, head->y, head->scale);
+	write_json_string(f, kanshi_transform_str(head->transform));
+	fprintf(f, ",\"adaptive_sync\":%s",
+		head->adaptive_sync ? "true" : "false");
+	if (profile_output != NULL) {
+		fprintf(f, ",\"criteria\":");
+		write_json_string(f, profile_output->name);
+	}
+	fputc('}', f);
+}
+
+static void write_status_json(FILE *f, struct kanshi_state *state,
+		struct kanshi_profile_output **matches) {
+	fputc('{', f);
+	if (state->current_profile != NULL) {
+		fprintf(f, "\"current_profile\":");
+		write_json_string(f, state->current_profile->name);
+		fputc(',', f);
+	}
+	if (state->pending_profile != NULL) {
+		fprintf(f, "\"pending_profile\":");
+		write_json_string(f, state->pending_profile->name);
+		fputc(',', f);
+	}
+	fprintf(f, "\"heads\":[");
+	size_t i = 0;
+	struct kanshi_head *head;
+	wl_list_for_each(head, &state->heads, link) {
+		if (i > 0) {
+			fputc(',', f);
+		}
+		write_head_json(f, head, matches[i]);
+		i++;
+	}
+	fprintf(f, "]}\n");
+}
+
+static void handle_status(struct kanshi_state *state,
+		struct kanshi_ipc_call *call, bool json) {
+	// The criteria to head mapping is the one of the current profile
+	struct kanshi_profile_output *matches[HEADS_MAX] = {0};
+	if (state->current_profile != NULL &&
+			!kanshi_match_profile(state, state->current_profile, matches)) {
+		memset(matches, 0, sizeof(matches));
+	}
+
+	char *buf = NULL;
+	size_t len = 0;
+	FILE *f = open_memstream(&buf, &len);
+	if (f == NULL) {
+		send_reply(call, false, "Error: out of memory\n");
+		return;
+	}
+	fprintf(f, "ok\n");
+	if (json) {
+		write_status_json(f, state, matches);
+	} else {
+		fprintf(f, "Current profile: %s\n", state->current_profile ?
+			state->current_profile->name : "(none)");
+		if (state->pending_profile != NULL) {
+			fprintf(f, "Pending profile: %s\n",
+				state->pending_profile->name);
+		}
+		size_t i = 0;
+		struct kanshi_head *head;
+		wl_list_for_each(head, &state->heads, link) {
+			write_head(f, head, matches[i]);
+			i++;
+		}
+	}
+	if (fclose(f) != 0) {
+		free(buf);
+		send_reply(call, false, "Error: out of memory\n");
+		return;
+	}
+	send_all(call, buf, len);
+	free(buf);
+}
+
+static void handle_log(struct kanshi_ipc_call *call) {
+	char *buf = NULL;
+	size_t len = 0;
+	FILE *f = open_memstream(&buf, &len);
+	if (f == NULL) {
+		send_reply(call, false, "Error: out of memory\n");
+		return;
+	}
+	fprintf(f, "ok\n");
+	kanshi_log_dump(f);
+	if (fclose(f) != 0) {
+		free(buf);
+		send_reply(call, false, "Error: out of memory\n");
+		return;
+	}
+	send_all(call, buf, len);
+	free(buf);
+}
+
+static void handle_request(struct kanshi_state *state,
+		struct kanshi_ipc_call *call) {
+	bool keep_open = false;
+	char *request = call->request;
+	char *arg = strchr(request, ' ');
+	if (arg != NULL) {
+		*arg = '\0';
+		arg++;
+	}
+	if (strcmp(request, "reload") == 0 && arg == NULL) {
+		keep_open = handle_reload(state, call);
+	} else if (strcmp(request, "switch") == 0 && arg != NULL) {
+		keep_open = handle_switch(state, call, arg);
+	} else if (strcmp(request, "test") == 0 && arg != NULL) {
+		keep_open = handle_test(state, call, arg);
+	} else if (strcmp(request, "apply") == 0 && call->body != NULL) {
+		keep_open = handle_apply(state, call);
+	} else if (strcmp(request, "status") == 0 && (arg == NULL ||
+			strcmp(arg, "--json") == 0)) {
+		handle_status(state, call, arg != NULL);
+	} else if (strcmp(request, "log") == 0 && arg == NULL) {
+		handle_log(call);
+	} else if (strcmp(request, "monitor") == 0 && arg == NULL) {
+		keep_open = send_reply(call, true, "%s", "");
+		if (keep_open) {
+			move_call(call, &state->monitors);
+		}
+	} else {
+		send_reply(call, false, "Error: invalid request\n");
+	}
+	if (!keep_open) {
+		finish_call(call);
+	}
+}
+
+// Sets up the body of apply requests, the rest of the request buffer is the
+// start of it. Invalid requests are left without one.
+static void start_body(struct kanshi_ipc_call *call, const char *rest) {
+	const char *p = call->request;
+	if (strncmp(p, "apply ", strlen("apply ")) != 0) {
+		return;
+	}
+	p += strlen("apply ");
+	bool keep = strncmp(p, "--keep ", strlen("--keep ")) == 0;
+	if (keep) {
+		p += strlen("--keep ");
+	}
+	char *end;
+	errno = 0;
+	unsigned long size = strtoul(p, &end, 10);
+	if (p[0] < '0' || p[0] > '9' || end[0] != '\0' || errno != 0 ||
+			size > BODY_MAX) {
+		return;
+	}
+
+	call->body = malloc(size + 1);
+	if (call->body == NULL) {
+		kanshi_log(KANSHI_LOG_ERROR, "failed to allocate IPC request");
+		return;
+	}
+	call->body_size = size;
+	call->keep = keep;
+	size_t rest_len = call->request + call->request_len - rest;
+	call->body_len = rest_len < size ? rest_len : size;
+	memcpy(call->body, rest, call->body_len);
+}
+
+// Returns false if the connection has been closed
+static bool read_call(struct kanshi_state *state,
+		struct kanshi_ipc_call *call) {
+	while (true) {
+		// Anything sent after the request is ignored, but reading it tells
+		// when the client goes away
+		char discard[64];
+		char *buf = discard;
+		size_t size = sizeof(discard);
+		if (!call->handled && call->body != NULL) {
+			buf = call->body + call->body_len;
+			size = call->body_size - call->body_len;
+		} else if (!call->handled) {
+			buf = call->request + call->request_len;
+			size = sizeof(call->request) - call->request_len - 1;
+		}
+		ssize_t n = recv(call->fd, buf, size, 0);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		} else if (n < 0 && errno == EAGAIN) {
+			return true;
+		} else if (n <= 0) {
+			destroy_call(call);
+			return false;
+		}
+		if (call->handled) {
+			continue;
+		}
+
+		if (call->body != NULL) {
+			call->body_len += n;
+		} else {
+			call->request_len += n;
+			call->request[call->request_len] = '\0';
+			char *end = strchr(call->request, '\n');
+			if (end == NULL) {
+				if (call->request_len + 1 == sizeof(call->request)) {
+					kanshi_log(KANSHI_LOG_ERROR,
+						"invalid or incomplete IPC request");
+					destroy_call(call);
+					return false;
+				}
+				continue;
+			}
+			*end = '\0';
+			start_body(call, end + 1);
+		}
+		if (call->body == NULL || call->body_len == call->body_size) {
+			if (call->body != NULL) {
+				call->body[call->body_len] = '\0';
+			}
+			call->handled = true;
+			handle_request(state, call);
+			return false; // The call may be gone
+		}
+	}
+}
+
+static void dispatch_call(struct kanshi_state *state,
+		struct kanshi_ipc_call *call, uint32_t events) {
+	if (events & EPOLLOUT) {
+		flush_call(call);
+		if (call->failed || (call->closing && call->out_len == 0)) {
+			destroy_call(call);
+			return;
+		}
+	}
+	if ((events & (EPOLLIN | EPOLLHUP | EPOLLERR)) &&
+			!read_call(state, call)) {
+		return;
+	}
+	if (call->failed) {
+		destroy_call(call);
+	}
+}
+
+static int accept_clients(struct kanshi_ipc_server *server) {
+	while (true) {
+		int fd = accept(server->fd, NULL, NULL);
+		if (fd < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno == EAGAIN || errno == ECONNABORTED) {
+				return 0;
+			}
+			kanshi_log(KANSHI_LOG_ERROR, "accept failed: %s", strerror(errno));
+			return -1;
+		}
+		struct kanshi_ipc_call *call = NULL;
+		if (set_fd_flags(fd) != 0 ||
+				(call = calloc(1, sizeof(*call))) == NULL) {
+			close(fd);
+			continue;
+		}
+		call->fd = fd;
+		call->server = server;
+		call->events = EPOLLIN;
+		struct epoll_event event = { .events = EPOLLIN, .data.ptr = call };
+		if (epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, fd, &event) != 0) {
+			kanshi_log(KANSHI_LOG_ERROR, "epoll_ctl failed: %s",
+				strerror(errno));
+			close(fd);
+			free(call);
+			continue;
+		}
+		wl_list_insert(server->clients.prev, &call->link);
+	}
+}
+
+int kanshi_ipc_dispatch(struct kanshi_state *state) {
+	struct kanshi_ipc_server *server = state->ipc_server;
+	while (true) {
+		// One event at a time: handling a call can destroy others
+		struct epoll_event event;
+		int n = epoll_wait(server->epoll_fd, &event, 1, 0);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		} else if (n < 0) {
+			kanshi_log(KANSHI_LOG_ERROR, "epoll_wait failed: %s",
+				strerror(errno));
+			return -1;
+		} else if (n == 0) {
+			return 0;
+		}
+		if (event.data.ptr == server) {
+			if (accept_clients(server) != 0) {
+				return -1;
+			}
+		} else {
+			dispatch_call(state, event.data.ptr, event.events);
+		}
+	}
+}
+
+int kanshi_ipc_get_fd(struct kanshi_state *state) {
+	if (state->ipc_server == NULL) {
+		return -1;
+	}
+	return state->ipc_server->epoll_fd;
+}
+
+// Returns true if another process is listening on the address
+static bool address_in_use(const struct sockaddr_un *addr) {
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) {
+		return true;
+	}
+	bool in_use = connect(fd, (const struct sockaddr *)addr,
+		sizeof(*addr)) == 0 || errno != ECONNREFUSED;
+	close(fd);
+	return in_use;
+}
+
+int kanshi_init_ipc(struct kanshi_state *state) {
+	char address[PATH_MAX];
+	if (get_ipc_address(address, sizeof(address), state->display_name) < 0) {
+		return -1;
+	}
+	const char *path = address + strlen("unix:");
+
+	struct kanshi_ipc_server *server = calloc(1, sizeof(*server));
+	if (server == NULL) {
+		return -1;
+	}
+	server->epoll_fd = -1;
+	wl_list_init(&server->clients);
+	server->addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(server->addr.sun_path)) {
+		kanshi_log(KANSHI_LOG_ERROR, "IPC socket path too long: %s", path);
+		free(server);
+		return -1;
+	}
+	strcpy(server->addr.sun_path, path);
+
+	server->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (server->fd < 0 || set_fd_flags(server->fd) != 0) {
+		kanshi_log(KANSHI_LOG_ERROR, "failed to create IPC socket: %s",
+			strerror(errno));
+		goto error;
+	}
+	if (bind(server->fd, (struct sockaddr *)&server->addr,
+			sizeof(server->addr)) != 0) {
+		// Remove the socket left behind by a daemon which didn't exit cleanly
+		if (errno != EADDRINUSE || address_in_use(&server->addr) ||
+				unlink(path) != 0 ||
+				bind(server->fd, (struct sockaddr *)&server->addr,
+					sizeof(server->addr)) != 0) {
+			kanshi_log(KANSHI_LOG_ERROR, "Couldn't start kanshi IPC socket at %s.\n"
+					"Is the kanshi daemon already running?", address);
+			goto error;
+		}
+	}
+	if (listen(server->fd, SOMAXCONN) != 0) {
+		kanshi_log(KANSHI_LOG_ERROR, "listen failed: %s", strerror(errno));
+		unlink(path);
+		goto error;
+	}
+
+	server->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	struct epoll_event event = { .events = EPOLLIN, .data.ptr = server };
+	if (server->epoll_fd < 0 || epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD,
+			server->fd, &event) != 0) {
+		kanshi_log(KANSHI_LOG_ERROR, "failed to create epoll fd: %s",
+			strerror(errno));
+		unlink(path);
+		goto error;
+	}
+
+	state->ipc_server = server;
+	wl_list_init(&state->monitors);
+	wl_list_init(&state->pending_calls);
+	wl_list_init(&state->test_calls);
+	wl_list_init(&state->reload_calls);
+
+	return 0;
+
+error:
+	if (server->epoll_fd >= 0) {
+		close(server->epoll_fd);
+	}
+	if (server->fd >= 0) {
+		close(server->fd);
+	}
+	free(server);
+	return -1;
+}
+
+void kanshi_free_ipc(struct kanshi_state *state) {
+	struct kanshi_ipc_server *server = state->ipc_server;
+	if (server == NULL) {
+		return;
+	}
+	struct kanshi_ipc_call *call, *tmp;
+	wl_list_for_each_safe(call, tmp, &state->monitors, link) {
+		destroy_call(call);
+	}
+	wl_list_for_each_safe(call, tmp, &state->pending_calls, link) {
+		destroy_call(call);
+	}
+	wl_list_for_each_safe(call, tmp, &state->test_calls, link) {
+		destroy_call(call);
+	}
+	wl_list_for_each_safe(call, tmp, &state->reload_calls, link) {
+		destroy_call(call);
+	}
+	wl_list_for_each_safe(call, tmp, &server->clients, link) {
+		destroy_call(call);
+	}
+	close(server->epoll_fd);
+	close(server->fd);
+	unlink(server->addr.sun_path);
+	free(server);
+	state->ipc_server = NULL;
+}
@@ -0,0 +1,78 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "ipc.h"
+
+// Each display managed by the daemon has its own socket, display defaults to
+// $WAYLAND_DISPLAY
+int get_ipc_address(char *address, size_t size, const char *display) {
+	const char *wayland_display =
+		display != NULL ? display : getenv("WAYLAND_DISPLAY");
+	const char *xdg_runtime_dir = getenv("XDG_RUNTIME_DIR");
+	if (!wayland_display || !wayland_display[0]) {
+		fprintf(stderr, "WAYLAND_DISPLAY is not set\n");
+		return -1;
+	}
+	if (!xdg_runtime_dir || !xdg_runtime_dir[0]) {
+		fprintf(stderr, "XDG_RUNTIME_DIR is not set\n");
+		return -1;
+	}
+
+	return snprintf(address, size, "unix:%s/fr.emersion.kanshi.%s",
+			xdg_runtime_dir, wayland_display);
+}
+
+const char *kanshi_event_type_str(enum kanshi_event_type type) {
+	switch (type) {
+	case KANSHI_EVENT_HEAD_ADDED:
+		return "head-added";
+	case KANSHI_EVENT_HEAD_REMOVED:
+		return "head-removed";
+	case KANSHI_EVENT_PROFILE_MATCHED:
+		return "profile-matched";
+	case KANSHI_EVENT_PROFILE_SKIPPED:
+		return "profile-skipped";
+	case KANSHI_EVENT_APPLY_STARTED:
+		return "apply-started";
+	case KANSHI_EVENT_APPLY_SUCCEEDED:
+		return "apply-succeeded";
+	case KANSHI_EVENT_APPLY_FAILED:
+		return "apply-failed";
+	case KANSHI_EVENT_APPLY_CANCELLED:
+		return "apply-cancelled";
+	case KANSHI_EVENT_APPLY_RETRYING:
+		return "apply-retrying";
+	case KANSHI_EVENT_TEST_SUCCEEDED:
+		return "test-succeeded";
+	case KANSHI_EVENT_TEST_FAILED:
+		return "test-failed";
+	case KANSHI_EVENT_TEST_CANCELLED:
+		return "test-cancelled";
+	case KANSHI_EVENT_RELOAD_DONE:
+		return "reload-done";
+	}
+	abort();
+}
+
+const char *kanshi_transform_str(enum wl_output_transform transform) {
+	switch (transform) {
+	case WL_OUTPUT_TRANSFORM_NORMAL:
+		return "normal";
+	case WL_OUTPUT_TRANSFORM_90:
+		return "90";
+	case WL_OUTPUT_TRANSFORM_180:
+		return "180";
+	case WL_OUTPUT_TRANSFORM_270:
+		return "270";
+	case WL_OUTPUT_TRANSFORM_FLIPPED:
+		return "flipped";
+	case WL_OUTPUT_TRANSFORM_FLIPPED_90:
+		return "flipped-90";
+	case WL_OUTPUT_TRANSFORM_FLIPPED_180:
+		return "flipped-180";
+	case WL_OUTPUT_TRANSFORM_FLIPPED_270:
+		return "flipped-270";
+	}
+	return "unknown";
+}
@@ -1,69 +1,592 @@
 #define _POSIX_C_SOURCE 200809L
 #include <limits.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <varlink.h>
 
+#include "config.h"
 #include "kanshi.h"
 #include "ipc.h"
+#include "log.h"
+#include "parser.h"
 
-static void reload_config_done(void *data, struct wl_callback *callback,
-		uint32_t serial) {
-	VarlinkCall *call = data;
-	varlink_call_reply(call, NULL, 0);
-	wl_callback_destroy(callback);
-}
+struct kanshi_ipc_call {
+	VarlinkCall *call;
+	struct wl_list link;
 
-static struct wl_callback_listener reload_config_listener = {
-	.done = reload_config_done
+	// Answered by the outcome of this transaction, or a later one if it
+	// doesn't get to the end, only set for pending calls
+	uint32_t transaction;
+	// Only set for test calls
+	char *profile, *plan;
 };
 
+static void destroy_call(struct kanshi_ipc_call *ipc_call) {
+	varlink_call_set_connection_closed_callback(ipc_call->call, NULL, NULL);
+	wl_list_remove(&ipc_call->link);
+	varlink_call_unref(ipc_call->call);
+	free(ipc_call->profile);
+	free(ipc_call->plan);
+	free(ipc_call);
+}
+
+static void call_handle_closed(VarlinkCall *call, void *userdata) {
+	struct kanshi_ipc_call *ipc_call = userdata;
+	destroy_call(ipc_call);
+}
+
+static struct kanshi_ipc_call *add_call(struct wl_list *list,
+		VarlinkCall *call) {
+	struct kanshi_ipc_call *ipc_call = calloc(1, sizeof(*ipc_call));
+	if (ipc_call == NULL) {
+		return NULL;
+	}
+	ipc_call->call = varlink_call_ref(call);
+	wl_list_insert(list->prev, &ipc_call->link);
+	varlink_call_set_connection_closed_callback(call,
+		call_handle_closed, ipc_call);
+	return ipc_call;
+}
+
+static long reply_apply_result(VarlinkCall *call, const char *profile,
+		const char *result) {
+	VarlinkObject *out;
+	varlink_object_new(&out);
+	if (profile != NULL) {
+		varlink_object_set_string(out, "profile", profile);
+	}
+	varlink_object_set_string(out, "result", result);
+	long ret = varlink_call_reply(call, out, 0);
+	varlink_object_unref(out);
+	return ret;
+}
+
+static long reply_test_result(VarlinkCall *call, const char *profile,
+		const char *result, const char *plan) {
+	VarlinkObject *out;
+	varlink_object_new(&out);
+	varlink_object_set_string(out, "profile", profile);
+	varlink_object_set_string(out, "result", result);
+	varlink_object_set_string(out, "plan", plan);
+	long ret = varlink_call_reply(call, out, 0);
+	varlink_object_unref(out);
+	return ret;
+}
+
+static long handle_monitor(VarlinkService *service, VarlinkCall *call,
+		VarlinkObject *parameters, uint64_t flags, void *userdata) {
+	struct kanshi_state *state = userdata;
+	if (!(flags & VARLINK_CALL_MORE)) {
+		return varlink_call_reply_error(call,
+			"fr.emersion.kanshi.ExpectedMore", NULL);
+	}
+	if (add_call(&state->monitors, call) == NULL) {
+		return -VARLINK_ERROR_PANIC;
+	}
+	return 0;
+}
+
+static void send_monitor_event(struct kanshi_state *state,
+		enum kanshi_event_type type, const char *profile, const char *output) {
+	VarlinkObject *out;
+	varlink_object_new(&out);
+	varlink_object_set_string(out, "event", kanshi_event_type_str(type));
+	if (profile != NULL) {
+		varlink_object_set_string(out, "profile", profile);
+	}
+	if (output != NULL) {
+		varlink_object_set_string(out, "output", output);
+	}
+
+	struct kanshi_ipc_call *monitor, *tmp;
+	wl_list_for_each_safe(monitor, tmp, &state->monitors, link) {
+		long result = varlink_call_reply(monitor->call, out,
+			VARLINK_REPLY_CONTINUES);
+		if (result != 0) {
+			kanshi_log(KANSHI_LOG_ERROR, "failed to send event to monitor: %s",
+				varlink_error_string(-result));
+			destroy_call(monitor);
+		}
+	}
+	varlink_object_unref(out);
+}
+
+void kanshi_ipc_send_event(struct kanshi_state *state,
+		enum kanshi_event_type type, const char *profile, const char *output) {
+	if (state->service == NULL) {
+		return;
+	}
+
+	if (!wl_list_empty(&state->monitors)) {
+		send_monitor_event(state, type, profile, output);
+	}
+
+	struct kanshi_ipc_call *pending, *tmp;
+	switch (type) {
+	case KANSHI_EVENT_TEST_SUCCEEDED:
+	case KANSHI_EVENT_TEST_FAILED:
+	case KANSHI_EVENT_TEST_CANCELLED:;
+		// Any test of the profile answers the calls waiting for it
+		const char *result = type == KANSHI_EVENT_TEST_SUCCEEDED ?
+			"succeeded" : type == KANSHI_EVENT_TEST_FAILED ?
+			"failed" : "cancelled";
+		wl_list_for_each_safe(pending, tmp, &state->test_calls, link) {
+			if (strcmp(pending->profile, profile) == 0) {
+				reply_test_result(pending->call, profile, result,
+					pending->plan);
+				destroy_call(pending);
+			}
+		}
+		break;
+	default:
+		break;
+	}
+}
+
+void kanshi_ipc_transaction_done(struct kanshi_state *state,
+		uint32_t transaction, enum kanshi_event_type type, const char *profile) {
+	if (state->service == NULL || transaction == 0) {
+		return;
+	}
+	const char *result = type == KANSHI_EVENT_APPLY_SUCCEEDED ? "succeeded" :
+		type == KANSHI_EVENT_APPLY_FAILED ? "failed" : "cancelled";
+	struct kanshi_ipc_call *pending, *tmp;
+	wl_list_for_each_safe(pending, tmp, &state->pending_calls, link) {
+		if (pending->transaction <= transaction) {
+			reply_apply_result(pending->call, profile, result);
+			destroy_call(pending);
+		}
+	}
+}
+
+static long handle_apply_result(struct kanshi_state *state, VarlinkCall *call,
+		enum kanshi_apply_result result) {
+	switch (result) {
+	case KANSHI_APPLY_PENDING:;
+		// Reply once the compositor has answered
+		struct kanshi_ipc_call *pending = add_call(&state->pending_calls,
+			call);
+		if (pending == NULL) {
+			return -VARLINK_ERROR_PANIC;
+		}
+		pending->transaction = kanshi_awaited_transaction(state);
+		return 0;
+	case KANSHI_APPLY_UNCHANGED:
+		return reply_apply_result(call, state->current_profile ?
+			state->current_profile->name : NULL, "unchanged");
+	case KANSHI_APPLY_NO_MATCH:
+		return reply_apply_result(call, NULL, "no-match");
+	case KANSHI_APPLY_FAILED:
+		return reply_apply_result(call, NULL, "failed");
+	}
+	abort();
+}
+
+// Picking a profile again didn't send a configuration, the calls waiting for
+// one won't get any
+void kanshi_ipc_apply_done(struct kanshi_state *state,
+		enum kanshi_apply_result result) {
+	if (state->service == NULL || result == KANSHI_APPLY_PENDING ||
+			state->transaction != NULL) {
+		return;
+	}
+	struct kanshi_ipc_call *pending, *tmp;
+	wl_list_for_each_safe(pending, tmp, &state->pending_calls, link) {
+		handle_apply_result(state, pending->call, result);
+		destroy_call(pending);
+	}
+}
+
+void kanshi_ipc_reload_done(struct kanshi_state *state, bool ok,
+		enum kanshi_apply_result result) {
+	if (state->service == NULL) {
+		return;
+	}
+	struct kanshi_ipc_call *pending, *tmp;
+	wl_list_for_each_safe(pending, tmp, &state->reload_calls, link) {
+		if (!ok) {
+			varlink_call_reply_error(pending->call,
+				"fr.emersion.kanshi.InvalidConfig", NULL);
+		} else if (result == KANSHI_APPLY_PENDING) {
+			// Reply once the compositor has answered
+			pending->transaction = kanshi_awaited_transaction(state);
+			wl_list_remove(&pending->link);
+			wl_list_insert(state->pending_calls.prev, &pending->link);
+			continue;
+		} else {
+			handle_apply_result(state, pending->call, result);
+		}
+		destroy_call(pending);
+	}
+}
+
 static long handle_reload(VarlinkService *service, VarlinkCall *call,
 		VarlinkObject *parameters, uint64_t flags, void *userdata) {
 	struct kanshi_state *state = userdata;
-	kanshi_reload_config(state);
-	// this only ensures that the server has received the configuration request,
-	// the server is free to wait an arbitrary amount of time before applying the configuration
-	// TODO: use the wlr-output-management event instead
-	struct wl_callback *callback = wl_display_sync(state->display);
-	wl_callback_add_listener(callback, &reload_config_listener, call);
+	if (!kanshi_reload_config(state->daemon)) {
+		return -VARLINK_ERROR_PANIC;
+	}
+	// Reply once the config is parsed
+	if (add_call(&state->reload_calls, call) == NULL) {
+		return -VARLINK_ERROR_PANIC;
+	}
 	return 0;
 }
 
+static struct kanshi_profile *find_profile(struct kanshi_state *state,
+		const char *name) {
+	struct kanshi_profile *profile;
+	wl_list_for_each(profile, &state->daemon->config->profiles, link) {
+		if (strcmp(profile->name, name) == 0) {
+			return profile;
+		}
+	}
+	return NULL;
+}
+
+static long handle_switch(VarlinkService *service, VarlinkCall *call,
+		VarlinkObject *parameters, uint64_t flags, void *userdata) {
+	struct kanshi_state *state = userdata;
+	const char *name;
+	if (varlink_object_get_string(parameters, "profile", &name) < 0) {
+		return varlink_call_reply_invalid_parameter(call, "profile");
+	}
+	if (state->daemon->config == NULL) {
+		return varlink_call_reply_error(call,
+			"fr.emersion.kanshi.ConfigNotLoaded", NULL);
+	}
+
+	struct kanshi_profile *profile = find_profile(state, name);
+	if (profile == NULL) {
+		return varlink_call_reply_error(call,
+			"fr.emersion.kanshi.ProfileNotFound", NULL);
+	}
+	return handle_apply_result(state, call,
+		kanshi_switch_profile(state, profile));
+}
+
+static long handle_test(VarlinkService *service, VarlinkCall *call,
+		VarlinkObject *parameters, uint64_t flags, void *userdata) {
+	struct kanshi_state *state = userdata;
+	const char *name;
+	if (varlink_object_get_string(parameters, "profile", &name) < 0) {
+		return varlink_call_reply_invalid_parameter(call, "profile");
+	}
+	if (state->daemon->config == NULL) {
+		return varlink_call_reply_error(call,
+			"fr.emersion.kanshi.ConfigNotLoaded", NULL);
+	}
+
+	struct kanshi_profile *profile = find_profile(state, name);
+	if (profile == NULL) {
+		return varlink_call_reply_error(call,
+			"fr.emersion.kanshi.ProfileNotFound", NULL);
+	}
+
+	char *plan = NULL;
+	size_t plan_len = 0;
+	FILE *f = open_memstream(&plan, &plan_len);
+	if (f == NULL) {
+		return -VARLINK_ERROR_PANIC;
+	}
+	bool matched = kanshi_describe_profile(state, profile, f);
+	if (fclose(f) != 0) {
+		free(plan);
+		return -VARLINK_ERROR_PANIC;
+	}
+	if (!matched) {
+		free(plan);
+		return reply_apply_result(call, name, "no-match");
+	}
+
+	long ret;
+	struct kanshi_ipc_call *ipc_call;
+	switch (kanshi_test_profile(state, profile)) {
+	case KANSHI_APPLY_PENDING:
+		// Reply once the compositor has answered
+		ipc_call = add_call(&state->test_calls, call);
+		if (ipc_call == NULL || (ipc_call->profile = strdup(name)) == NULL) {
+			free(plan);
+			return -VARLINK_ERROR_PANIC;
+		}
+		ipc_call->plan = plan;
+		return 0;
+	case KANSHI_APPLY_NO_MATCH:
+		ret = reply_test_result(call, name, "no-match", plan);
+		break;
+	default:
+		ret = reply_test_result(call, name, "failed", plan);
+		break;
+	}
+	free(plan);
+	return ret;
+}
+
+static long handle_apply(VarlinkService *service, VarlinkCall *call,
+		VarlinkObject *parameters, uint64_t flags, void *userdata) {
+	struct kanshi_state *state = userdata;
+	const char *str;
+	if (varlink_object_get_string(parameters, "config", &str) < 0) {
+		return varlink_call_reply_invalid_parameter(call, "config");
+	}
+	bool keep = false;
+	varlink_object_get_bool(parameters, "keep", &keep);
+
+	struct kanshi_config *config = parse_override_str(str);
+	if (config == NULL) {
+		return varlink_call_reply_error(call,
+			"fr.emersion.kanshi.InvalidConfig", NULL);
+	}
+	if (wl_list_length(&config->profiles) != 1) {
+		kanshi_log(KANSHI_LOG_ERROR, "expected exactly one profile, got %d",
+			wl_list_length(&config->profiles));
+		destroy_config(config);
+		return varlink_call_reply_error(call,
+			"fr.emersion.kanshi.InvalidConfig", NULL);
+	}
+
+	return handle_apply_result(state, call,
+		kanshi_apply_override(state, config, keep));
+}
+
+static VarlinkObject *mode_to_object(struct kanshi_mode *mode) {
+	VarlinkObject *obj;
+	varlink_object_new(&obj);
+	varlink_object_set_int(obj, "width", mode->width);
+	varlink_object_set_int(obj, "height", mode->height);
+	varlink_object_set_int(obj, "refresh", mode->refresh);
+	varlink_object_set_bool(obj, "preferred", mode->preferred);
+	return obj;
+}
+
+static VarlinkObject *head_to_object(struct kanshi_head *head,
+		struct kanshi_profile_output *profile_output) {
+	VarlinkObject *obj;
+	varlink_object_new(&obj);
+	varlink_object_set_string(obj, "name", head->name ? head->name : "");
+	varlink_object_set_string(obj, "description",
+		head->description ? head->description : "");
+	if (head->identifier != NULL) {
+		varlink_object_set_string(obj, "identifier", head->identifier);
+	}
+	varlink_object_set_bool(obj, "enabled", head->enabled);
+	if (head->mode != NULL) {
+		VarlinkObject *mode = mode_to_object(head->mode);
+		varlink_object_set_object(obj, "current_mode", mode);
+		varlink_object_unref(mode);
+	} else if (head->custom_mode.width > 0) {
+		VarlinkObject *mode;
+		varlink_object_new(&mode);
+		varlink_object_set_int(mode, "width", head->custom_mode.width);
+		varlink_object_set_int(mode, "height", head->custom_mode.height);
+		varlink_object_set_int(mode, "refresh", head->custom_mode.refresh);
+		varlink_object_set_bool(mode, "preferred", false);
+		varlink_object_set_bool(mode, "custom", true);
+		varlink_object_set_object(obj, "current_mode", mode);
+		varlink_object_unref(mode);
+	}
+
+	VarlinkArray *modes;
+	varlink_array_new(&modes);
+	struct kanshi_mode *mode;
+	wl_list_for_each(mode, &head->modes, link) {
+		VarlinkObject *mode_obj = mode_to_object(mode);
+		varlink_array_append_object(modes, mode_obj);
+		varlink_object_unref(mode_obj);
+	}
+	varlink_object_set_array(obj, "modes", modes);
+	varlink_array_unref(modes);
+
+	varlink_object_set_int(obj, "x", head->x);
+	varlink_object_set_int(obj, "y", head->y);
+	varlink_object_set_float(obj, "scale", head->scale);
+	varlink_object_set_string(obj, "transform",
+		kanshi_transform_str(head->transform));
+	varlink_object_set_bool(obj, "adaptive_sync", head->adaptive_sync);
+	if (profile_output != NULL) {
+		varlink_object_set_string(obj, "criteria", profile_output->name);
+	}
+	return obj;
+}
+
+static long handle_status(VarlinkService *service, VarlinkCall *call,
+		VarlinkObject *parameters, uint64_t flags, void *userdata) {
+	struct kanshi_state *state = userdata;
+
+	// The criteria to head mapping is the one of the current profile
+	struct kanshi_profile_output *matches[HEADS_MAX] = {0};
+	if (state->current_profile != NULL &&
+			!kanshi_match_profile(state, state->current_profile, matches)) {
+		memset(matches, 0, sizeof(matches));
+	}
+
+	VarlinkObject *out;
+	varlink_object_new(&out);
+	if (state->current_profile != NULL) {
+		varlink_object_set_string(out, "current_profile",
+			state->current_profile->name);
+	}
+	if (state->pending_profile != NULL) {
+		varlink_object_set_string(out, "pending_profile",
+			state->pending_profile->name);
+	}
+
+	VarlinkArray *heads;
+	varlink_array_new(&heads);
+	size_t i = 0;
+	struct kanshi_head *head;
+	wl_list_for_each(head, &state->heads, link) {
+		VarlinkObject *head_obj = head_to_object(head, matches[i]);
+		varlink_array_append_object(heads, head_obj);
+		varlink_object_unref(head_obj);
+		i++;
+	}
+	varlink_object_set_array(out, "heads", heads);
+	varlink_array_unref(heads);
+
+	long result = varlink_call_reply(call, out, 0);
+	varlink_object_unref(out);
+	return result;
+}
+
+static long handle_log(VarlinkService *service, VarlinkCall *call,
+		VarlinkObject *parameters, uint64_t flags, void *userdata) {
+	char *buf = NULL;
+	size_t len = 0;
+	FILE *f = open_memstream(&buf, &len);
+	if (f == NULL) {
+		return -VARLINK_ERROR_PANIC;
+	}
+	kanshi_log_dump(f);
+	if (fclose(f) != 0) {
+		free(buf);
+		return -VARLINK_ERROR_PANIC;
+	}
+
+	VarlinkArray *lines;
+	varlink_array_new(&lines);
+	char *saveptr = NULL;
+	for (char *line = strtok_r(buf, "\n", &saveptr); line != NULL;
+			line = strtok_r(NULL, "\n", &saveptr)) {
+		varlink_array_append_string(lines, line);
+	}
+	free(buf);
+
+	VarlinkObject *out;
+	varlink_object_new(&out);
+	varlink_object_set_array(out, "lines", lines);
+	varlink_array_unref(lines);
+	long result = varlink_call_reply(call, out, 0);
+	varlink_object_unref(out);
+	return result;
+}
+
 int kanshi_init_ipc(struct kanshi_state *state) {
 	VarlinkService *service;
 	char address[PATH_MAX];
-	if (get_ipc_address(address, sizeof(address)) < 0) {
+	if (get_ipc_address(address, sizeof(address), state->display_name) < 0) {
 		return -1;
 	}
 	if (varlink_service_new(&service,
 			"emersion", "kanshi", KANSHI_VERSION, "https://wayland.emersion.fr/kanshi/",
 			address, -1) < 0) {
-		fprintf(stderr, "Couldn't start kanshi varlink service at %s.\n"
-				"Is the kanshi daemon already running?\n", address);
+		kanshi_log(KANSHI_LOG_ERROR, "Couldn't start kanshi varlink service at %s.\n"
+				"Is the kanshi daemon already running?", address);
 		return -1;
 	}
 
 	const char *interface = "interface fr.emersion.kanshi\n"
-		"method Reload() -> ()";
+		"type Mode (width: int, height: int, refresh: int, preferred: bool,\n"
+		"  custom: ?bool)\n"
+		"type Head (\n"
+		"  name: string,\n"
+		"  description: string,\n"
+		"  identifier: ?string,\n"
+		"  enabled: bool,\n"
+		"  current_mode: ?Mode,\n"
+		"  modes: []Mode,\n"
+		"  x: int,\n"
+		"  y: int,\n"
+		"  scale: float,\n"
+		"  transform: string,\n"
+		"  adaptive_sync: bool,\n"
+		"  criteria: ?string\n"
+		")\n"
+		"method Reload() -> (profile: ?string, result: string)\n"
+		"method Switch(profile: string) -> (profile: ?string, result: string)\n"
+		"method Apply(config: string, keep: ?bool) -> (profile: ?string, result: string)\n"
+		"method Test(profile: string) -> (profile: ?string, result: string, plan: ?string)\n"
+		"method Monitor() -> (event: string, profile: ?string, output: ?string)\n"
+		"method Status() -> (\n"
+		"  current_profile: ?string,\n"
+		"  pending_profile: ?string,\n"
+		"  heads: []Head\n"
+		")\n"
+		"method Log() -> (lines: []string)\n"
+		"error ExpectedMore ()\n"
+		"error ConfigNotLoaded ()\n"
+		"error InvalidConfig ()\n"
+		"error ProfileNotFound ()";
 
 	long result = varlink_service_add_interface(service, interface,
 			"Reload", handle_reload, state,
+			"Switch", handle_switch, state,
+			"Apply", handle_apply, state,
+			"Test", handle_test, state,
+			"Status", handle_status, state,
+			"Monitor", handle_monitor, state,
+			"Log", handle_log, state,
 			NULL);
 	if (result != 0) {
-		fprintf(stderr, "varlink_service_add_interface failed: %s\n",
+		kanshi_log(KANSHI_LOG_ERROR, "varlink_service_add_interface failed: %s",
 				varlink_error_string(-result));
 		varlink_service_free(service);
 		return -1;
 	}
 
 	state->service = service;
+	wl_list_init(&state->monitors);
+	wl_list_init(&state->pending_calls);
+	wl_list_init(&state->test_calls);
+	wl_list_init(&state->reload_calls);
 
 	return 0;
 }
 
 void kanshi_free_ipc(struct kanshi_state *state) {
 	if (state->service) {
+		struct kanshi_ipc_call *ipc_call, *tmp;
+		wl_list_for_each_safe(ipc_call, tmp, &state->monitors, link) {
+			destroy_call(ipc_call);
+		}
+		wl_list_for_each_safe(ipc_call, tmp, &state->pending_calls, link) {
+			destroy_call(ipc_call);
+		}
+		wl_list_for_each_safe(ipc_call, tmp, &state->test_calls, link) {
+			destroy_call(ipc_call);
+		}
+		wl_list_for_each_safe(ipc_call, tmp, &state->reload_calls, link) {
+			destroy_call(ipc_call);
+		}
 		varlink_service_free(state->service);
 		state->service = NULL;
 	}
 }
+
+int kanshi_ipc_get_fd(struct kanshi_state *state) {
+	if (state->service == NULL) {
+		return -1;
+	}
+	return varlink_service_get_fd(state->service);
+}
+
+int kanshi_ipc_dispatch(struct kanshi_state *state) {
+	long result = varlink_service_process_events(state->service);
+	if (result != 0) {
+		kanshi_log(KANSHI_LOG_ERROR, "varlink_service_process_events failed: %s",
+				varlink_error_string(-result));
+		return -1;
+	}
+	return 0;
+}
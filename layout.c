@@ -0,0 +1,251 @@
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "ipc.h"
+#include "kanshi.h"
+#include "layout.h"
+#include "log.h"
+#include "parser.h"
+
+// The last applied layout of each set of heads is stored as a config file
+// containing a single profile, with all the settings resolved
+
+static const char *head_key(struct kanshi_head *head) {
+	return head->identifier != NULL ? head->identifier : head->name;
+}
+
+static int compare_keys(const void *a, const void *b) {
+	return strcmp(*(const char *const *)a, *(const char *const *)b);
+}
+
+// Identifies the set of connected heads, regardless of their order
+static bool heads_fingerprint(struct kanshi_state *state, uint32_t *out) {
+	const char *keys[HEADS_MAX];
+	size_t n = 0;
+	struct kanshi_head *head;
+	wl_list_for_each(head, &state->heads, link) {
+		if (n == HEADS_MAX || head->name == NULL) {
+			return false;
+		}
+		keys[n] = head_key(head);
+		n++;
+	}
+	qsort(keys, n, sizeof(keys[0]), compare_keys);
+
+	char *buf = NULL;
+	size_t len = 0;
+	FILE *f = open_memstream(&buf, &len);
+	if (f == NULL) {
+		return false;
+	}
+	for (size_t i = 0; i < n; i++) {
+		fprintf(f, "%s\n", keys[i]);
+	}
+	if (fclose(f) != 0) {
+		free(buf);
+		return false;
+	}
+	*out = hash_criteria(buf);
+	free(buf);
+	return true;
+}
+
+static bool mkdir_parents(char *path) {
+	for (char *c = strchr(path + 1, '/'); c != NULL; c = strchr(c + 1, '/')) {
+		*c = '\0';
+		int ret = mkdir(path, 0755);
+		*c = '/';
+		if (ret != 0 && errno != EEXIST) {
+			kanshi_log(KANSHI_LOG_ERROR, "failed to create directory for %s: %s",
+				path, strerror(errno));
+			return false;
+		}
+	}
+	return true;
+}
+
+static bool get_layout_path(struct kanshi_state *state, char *path,
+		size_t size) {
+	uint32_t fingerprint;
+	if (!heads_fingerprint(state, &fingerprint)) {
+		return false;
+	}
+
+	const char *xdg_state_home = getenv("XDG_STATE_HOME");
+	const char *home = getenv("HOME");
+	int ret;
+	if (xdg_state_home != NULL && xdg_state_home[0] == '/') {
+		ret = snprintf(path, size, "%s/kanshi/layout-%08x",
+			xdg_state_home, fingerprint);
+	} else if (home != NULL) {
+		ret = snprintf(path, size, "%s/.local/state/kanshi/layout-%08x",
+			home, fingerprint);
+	} else {
+		kanshi_log(KANSHI_LOG_ERROR, "HOME not set");
+		return false;
+	}
+	return ret >= 0 && (size_t)ret < size;
+}
+
+static void write_mode(FILE *f, bool custom, int width, int height,
+		int refresh) {
+	fprintf(f, " mode %s%dx%d", custom ? "--custom " : "", width, height);
+	if (refresh > 0) {
+		fprintf(f, "@%.3fHz", (double)refresh / 1000);
+	}
+}
+
+// With all, settings left to the compositor are written too
+static void write_output(FILE *f, struct kanshi_head *head,
+		struct kanshi_profile_output *profile_output, bool all) {
+	const struct kanshi_output_settings *settings =
+		profile_output != NULL ? profile_output->settings : NULL;
+	unsigned int fields = settings != NULL ? settings->fields : 0;
+
+	const char *criteria = head_key(head);
+	if (strchr(criteria, '"') != NULL) {
+		criteria = head->name;
+	}
+	fprintf(f, "\toutput \"%s\"", criteria);
+
+	bool enabled = head->enabled;
+	if (fields & KANSHI_OUTPUT_ENABLED) {
+		enabled = settings->enabled;
+	}
+	if (!enabled) {
+		fprintf(f, " disable\n");
+		return;
+	}
+	fprintf(f, " enable");
+
+	struct kanshi_mode *mode = NULL;
+	if (fields & KANSHI_OUTPUT_MODE) {
+		mode = kanshi_select_mode(head, settings);
+		if (mode == NULL && settings->mode.custom) {
+			write_mode(f, true, settings->mode.width, settings->mode.height,
+				settings->mode.refresh);
+		}
+	} else if (head->mode != NULL) {
+		mode = head->mode;
+	} else if (head->custom_mode.width > 0) {
+		write_mode(f, true, head->custom_mode.width, head->custom_mode.height,
+			head->custom_mode.refresh);
+	}
+	if (mode != NULL) {
+		write_mode(f, false, mode->width, mode->height, mode->refresh);
+	}
+
+	if (fields & KANSHI_OUTPUT_POSITION) {
+		fprintf(f, " position %d,%d", settings->position.x,
+			settings->position.y);
+	} else {
+		fprintf(f, " position %d,%d", head->x, head->y);
+	}
+	fprintf(f, " scale %f", (fields & KANSHI_OUTPUT_SCALE) ?
+		settings->scale : head->scale);
+	fprintf(f, " transform %s", kanshi_transform_str(
+		(fields & KANSHI_OUTPUT_TRANSFORM) ?
+		settings->transform : head->transform));
+	if (fields & KANSHI_OUTPUT_ADAPTIVE_SYNC) {
+		fprintf(f, " adaptive_sync %s", settings->adaptive_sync ? "on" : "off");
+	} else if (all) {
+		fprintf(f, " adaptive_sync %s", head->adaptive_sync ? "on" : "off");
+	}
+	fprintf(f, "\n");
+}
+
+bool kanshi_save_layout(struct kanshi_state *state,
+		struct kanshi_profile *profile,
+		struct kanshi_profile_output **matches) {
+	char path[PATH_MAX];
+	if (!get_layout_path(state, path, sizeof(path)) || !mkdir_parents(path)) {
+		return false;
+	}
+	char tmp_path[PATH_MAX + 8];
+	snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+	FILE *f = fopen(tmp_path, "w");
+	if (f == NULL) {
+		kanshi_log(KANSHI_LOG_ERROR, "failed to open %s: %s",
+			tmp_path, strerror(errno));
+		return false;
+	}
+	const char *name = profile->name;
+	if (strchr(name, '"') != NULL) {
+		name = "restored";
+	}
+	fprintf(f, "# Last layout applied by kanshi for these outputs\n");
+	fprintf(f, "profile \"%s\" {\n", name);
+	ssize_t i = -1;
+	struct kanshi_head *head;
+	wl_list_for_each(head, &state->heads, link) {
+		i++;
+		write_output(f, head, matches[i], false);
+	}
+	fprintf(f, "}\n");
+
+	if (fclose(f) != 0) {
+		kanshi_log(KANSHI_LOG_ERROR, "failed to write %s: %s",
+			tmp_path, strerror(errno));
+		unlink(tmp_path);
+		return false;
+	}
+	if (rename(tmp_path, path) != 0) {
+		kanshi_log(KANSHI_LOG_ERROR, "failed to rename %s: %s",
+			tmp_path, strerror(errno));
+		unlink(tmp_path);
+		return false;
+	}
+	return true;
+}
+
+// Resolves the settings of all the heads from the profile outputs
+static char *describe_layout(struct kanshi_state *state,
+		struct kanshi_profile_output **matches) {
+	char *buf = NULL;
+	size_t len = 0;
+	FILE *f = open_memstream(&buf, &len);
+	if (f == NULL) {
+		return NULL;
+	}
+	ssize_t i = -1;
+	struct kanshi_head *head;
+	wl_list_for_each(head, &state->heads, link) {
+		i++;
+		write_output(f, head, matches[i], true);
+	}
+	if (fclose(f) != 0) {
+		free(buf);
+		return NULL;
+	}
+	return buf;
+}
+
+bool kanshi_same_layout(struct kanshi_state *state,
+		struct kanshi_profile_output **a, struct kanshi_profile_output **b) {
+	char *layout_a = describe_layout(state, a);
+	char *layout_b = describe_layout(state, b);
+	bool same = layout_a != NULL && layout_b != NULL &&
+		strcmp(layout_a, layout_b) == 0;
+	free(layout_a);
+	free(layout_b);
+	return same;
+}
+
+struct kanshi_config *kanshi_load_layout(struct kanshi_state *state) {
+	char path[PATH_MAX];
+	if (!get_layout_path(state, path, sizeof(path))) {
+		return NULL;
+	}
+	if (access(path, R_OK) != 0) {
+		return NULL; // Never applied a layout for these outputs
+	}
+	return parse_config(path);
+}
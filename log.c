@@ -0,0 +1,143 @@
+#define _POSIX_C_SOURCE 200809L
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "log.h"
+
+#define LOG_MESSAGE_MAX 512
+
+struct log_entry {
+	struct timespec time;
+	enum kanshi_log_level level;
+	const char *file;
+	int line;
+	char message[LOG_MESSAGE_MAX];
+};
+
+static enum kanshi_log_level stderr_level = KANSHI_LOG_INFO;
+
+// Ring buffer of the most recent messages up to history_level, also written
+// to by the reload thread
+static pthread_mutex_t history_lock = PTHREAD_MUTEX_INITIALIZER;
+static enum kanshi_log_level history_level = KANSHI_LOG_DEBUG;
+static struct log_entry *history = NULL;
+static int history_len = 0;
+static int history_next = 0;
+static int history_count = 0;
+
+static const char *level_names[] = {
+	[KANSHI_LOG_SILENT] = "silent",
+	[KANSHI_LOG_ERROR] = "error",
+	[KANSHI_LOG_INFO] = "info",
+	[KANSHI_LOG_DEBUG] = "debug",
+};
+
+bool kanshi_log_init(enum kanshi_log_level level,
+		enum kanshi_log_level history_max_level, int len) {
+	stderr_level = level;
+	history_level = history_max_level;
+	if (len > 0) {
+		history = calloc(len, sizeof(history[0]));
+		if (history == NULL) {
+			fprintf(stderr, "failed to allocate log history\n");
+			return false;
+		}
+	}
+	history_len = len;
+	history_next = 0;
+	history_count = 0;
+	return true;
+}
+
+void kanshi_log_finish(void) {
+	free(history);
+	history = NULL;
+	history_len = 0;
+}
+
+bool kanshi_log_enabled(enum kanshi_log_level level) {
+	return level <= stderr_level ||
+		(history_len > 0 && level <= history_level);
+}
+
+static const char *basename_of(const char *path) {
+	const char *slash = strrchr(path, '/');
+	return slash != NULL ? slash + 1 : path;
+}
+
+void kanshi_log_write(enum kanshi_log_level level, const char *file, int line,
+		const char *fmt, ...) {
+	char message[LOG_MESSAGE_MAX];
+	va_list args;
+	va_start(args, fmt);
+	vsnprintf(message, sizeof(message), fmt, args);
+	va_end(args);
+
+	if (level <= stderr_level) {
+		fprintf(stderr, "[%s] %s\n", kanshi_log_level_str(level), message);
+	}
+
+	if (history_len == 0 || level > history_level) {
+		return;
+	}
+	pthread_mutex_lock(&history_lock);
+	struct log_entry *entry = &history[history_next];
+	clock_gettime(CLOCK_MONOTONIC, &entry->time);
+	entry->level = level;
+	entry->file = basename_of(file);
+	entry->line = line;
+	memcpy(entry->message, message, sizeof(message));
+	history_next = (history_next + 1) % history_len;
+	if (history_count < history_len) {
+		history_count++;
+	}
+	pthread_mutex_unlock(&history_lock);
+}
+
+static void write_quoted(FILE *f, const char *str) {
+	fputc('"', f);
+	for (const char *c = str; *c != '\0'; c++) {
+		if (*c == '\n') {
+			fputs("\\n", f);
+			continue;
+		}
+		if (*c == '"' || *c == '\\') {
+			fputc('\\', f);
+		}
+		fputc(*c, f);
+	}
+	fputc('"', f);
+}
+
+void kanshi_log_dump(FILE *f) {
+	pthread_mutex_lock(&history_lock);
+	int start = (history_next - history_count + history_len) %
+		(history_len > 0 ? history_len : 1);
+	for (int i = 0; i < history_count; i++) {
+		const struct log_entry *entry = &history[(start + i) % history_len];
+		fprintf(f, "time=%lld.%03ld level=%s source=%s:%d message=",
+			(long long)entry->time.tv_sec, entry->time.tv_nsec / 1000000,
+			kanshi_log_level_str(entry->level), entry->file, entry->line);
+		write_quoted(f, entry->message);
+		fputc('\n', f);
+	}
+	pthread_mutex_unlock(&history_lock);
+}
+
+const char *kanshi_log_level_str(enum kanshi_log_level level) {
+	return level_names[level];
+}
+
+bool kanshi_log_parse_level(const char *str, enum kanshi_log_level *out) {
+	for (size_t i = 0; i < sizeof(level_names) / sizeof(level_names[0]); i++) {
+		if (strcmp(str, level_names[i]) == 0) {
+			*out = i;
+			return true;
+		}
+	}
+	return false;
+}
@@ -4,9 +4,11 @@
 #include <fcntl.h>
 #include <getopt.h>
 #include <limits.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <unistd.h>
@@ -16,23 +18,59 @@
 #include "kanshi.h"
 #include "parser.h"
 #include "ipc.h"
+#include "layout.h"
+#include "log.h"
+#include "metrics.h"
+#include "probes.h"
+#include "trace.h"
 #include "wlr-output-management-unstable-v1-client-protocol.h"
 
-#define HEADS_MAX 64
+// How long the compositor has to answer a configuration
+#define TRANSACTION_TIMEOUT_MS 10000
+// Cancelled configurations are retried after 100, 200, 400... ms
+#define RETRY_DELAY_MS 100
+#define MAX_RETRIES 5
+// Highest wlr-output-management version supported
+#define OUTPUT_MANAGER_VERSION 4
+// Reconnection attempts are spaced by 100, 200, 400... ms, up to 10 s
+#define RECONNECT_DELAY_MS 100
+#define RECONNECT_MAX_DELAY_MS 10000
+
+static bool match_identifier(struct kanshi_profile_output *output,
+		struct kanshi_head *head) {
+	return head->identifier != NULL &&
+		output->name_hash == head->identifier_hash &&
+		strcmp(output->name, head->identifier) == 0;
+}
 
 static bool match_profile_output(struct kanshi_profile_output *output,
 		struct kanshi_head *head) {
-	// TODO: improve vendor/model/serial matching
 	return strcmp(output->name, "*") == 0 ||
 		strcmp(output->name, head->name) == 0 ||
+		match_identifier(output, head) ||
 		(strchr(output->name, ' ') != NULL &&
 		strstr(head->description, output->name) != NULL);
 }
 
-static bool match_profile(struct kanshi_state *state,
+// Exact names and identifiers are more specific than descriptions, which
+// are more specific than wildcards. Identifiers and descriptions both
+// contain spaces, so the criteria can only be told apart once matched.
+static unsigned int match_specificity(struct kanshi_profile_output *output,
+		struct kanshi_head *head) {
+	if (strcmp(output->name, "*") == 0) {
+		return 0;
+	} else if (strcmp(output->name, head->name) == 0 ||
+			match_identifier(output, head)) {
+		return 2;
+	}
+	return 1;
+}
+
+bool kanshi_match_profile(struct kanshi_state *state,
 		struct kanshi_profile *profile,
 		struct kanshi_profile_output *matches[static HEADS_MAX]) {
-	if (wl_list_length(&profile->outputs) != wl_list_length(&state->heads)) {
+	int heads_len = wl_list_length(&state->heads);
+	if (!profile->partial && wl_list_length(&profile->outputs) != heads_len) {
 		return false;
 	}
 
@@ -42,6 +80,17 @@ static bool match_profile(struct kanshi_state *state,
 	// last
 	struct kanshi_profile_output *profile_output;
 	wl_list_for_each(profile_output, &profile->outputs, link) {
+		if (profile->partial && strcmp(profile_output->name, "*") == 0) {
+			// The first wildcard of a partial profile applies to all the
+			// heads left unmatched, other wildcards are ignored
+			for (int i = 0; i < heads_len; i++) {
+				if (matches[i] == NULL) {
+					matches[i] = profile_output;
+				}
+			}
+			break;
+		}
+
 		bool output_matched = false;
 		ssize_t i = -1;
 		struct kanshi_head *head;
@@ -67,19 +116,327 @@ static bool match_profile(struct kanshi_state *state,
 	return true;
 }
 
-static struct kanshi_profile *match(struct kanshi_state *state,
-		struct kanshi_profile_output *matches[static HEADS_MAX]) {
-	struct kanshi_profile *profile;
-	wl_list_for_each(profile, &state->config->profiles, link) {
-		if (match_profile(state, profile, matches)) {
-			return profile;
+static void send_event(struct kanshi_state *state,
+		enum kanshi_event_type type, struct kanshi_profile *profile,
+		struct kanshi_head *head) {
+	state->metrics.events[type]++;
+	kanshi_ipc_send_event(state, type, profile ? profile->name : NULL,
+		head ? head->name : NULL);
+}
+
+// The final outcome of a transaction, which answers the IPC calls waiting
+// for it
+static void send_outcome(struct kanshi_state *state,
+		enum kanshi_event_type type, struct kanshi_profile *profile,
+		uint32_t transaction) {
+	if (profile != NULL) {
+		send_event(state, type, profile, NULL);
+	}
+	kanshi_ipc_transaction_done(state, transaction, type,
+		profile ? profile->name : NULL);
+}
+
+static bool match_refresh(const struct kanshi_mode *mode, int refresh) {
+	int v = refresh - mode->refresh;
+	return abs(v) < 50;
+}
+
+static struct kanshi_mode *match_mode(struct kanshi_head *head,
+		int width, int height, int refresh) {
+	struct kanshi_mode *mode;
+	struct kanshi_mode *last_match = NULL;
+
+	wl_list_for_each(mode, &head->modes, link) {
+		if (mode->width != width || mode->height != height) {
+			continue;
+		}
+
+		if (refresh) {
+			if (match_refresh(mode, refresh)) {
+				return mode;
+			}
+		} else {
+			if (!last_match || mode->refresh > last_match->refresh) {
+				last_match = mode;
+			}
 		}
 	}
-	return NULL;
+
+	return last_match;
+}
+
+static int64_t mode_area(const struct kanshi_mode *mode) {
+	return (int64_t)mode->width * mode->height;
+}
+
+// Resolves the mode requested by a profile output against the modes of a
+// head, returns NULL if none fits
+struct kanshi_mode *kanshi_select_mode(struct kanshi_head *head,
+		const struct kanshi_output_settings *settings) {
+	struct kanshi_mode *mode, *best = NULL;
+	switch (settings->mode.policy) {
+	case KANSHI_MODE_EXACT:
+		return match_mode(head, settings->mode.width, settings->mode.height,
+			settings->mode.refresh);
+	case KANSHI_MODE_PREFERRED:
+		wl_list_for_each(mode, &head->modes, link) {
+			if (mode->preferred) {
+				return mode;
+			}
+		}
+		return NULL;
+	case KANSHI_MODE_HIGHEST_REFRESH:
+		wl_list_for_each(mode, &head->modes, link) {
+			if (best == NULL || mode->refresh > best->refresh ||
+					(mode->refresh == best->refresh &&
+					mode_area(mode) > mode_area(best))) {
+				best = mode;
+			}
+		}
+		return best;
+	case KANSHI_MODE_HIGHEST_RESOLUTION:
+		wl_list_for_each(mode, &head->modes, link) {
+			if (best == NULL || mode_area(mode) > mode_area(best) ||
+					(mode_area(mode) == mode_area(best) &&
+					mode->refresh > best->refresh)) {
+				best = mode;
+			}
+		}
+		return best;
+	}
+	abort();
+}
+
+static const char *mode_policy_str(enum kanshi_mode_policy policy) {
+	switch (policy) {
+	case KANSHI_MODE_EXACT:
+		return "exact";
+	case KANSHI_MODE_PREFERRED:
+		return "preferred";
+	case KANSHI_MODE_HIGHEST_REFRESH:
+		return "highest-refresh";
+	case KANSHI_MODE_HIGHEST_RESOLUTION:
+		return "highest-resolution";
+	}
+	abort();
+}
+
+static void describe_configuration(struct kanshi_state *state,
+		struct kanshi_profile_output **matches, FILE *f) {
+	ssize_t i = -1;
+	struct kanshi_head *head;
+	wl_list_for_each(head, &state->heads, link) {
+		i++;
+		struct kanshi_profile_output *profile_output = matches[i];
+		if (profile_output == NULL) {
+			fprintf(f, "%s: unchanged\n", head->name);
+			continue;
+		}
+		fprintf(f, "%s (%s):", head->name, profile_output->name);
+		const struct kanshi_output_settings *settings =
+			profile_output->settings;
+
+		bool enabled = head->enabled;
+		if (settings->fields & KANSHI_OUTPUT_ENABLED) {
+			enabled = settings->enabled;
+		}
+		if (!enabled) {
+			fprintf(f, " disable\n");
+			continue;
+		}
+
+		fprintf(f, " enable");
+		if (settings->fields & KANSHI_OUTPUT_MODE) {
+			struct kanshi_mode *mode = kanshi_select_mode(head, settings);
+			if (settings->mode.policy != KANSHI_MODE_EXACT) {
+				fprintf(f, ", mode %s",
+					mode_policy_str(settings->mode.policy));
+				if (mode != NULL) {
+					fprintf(f, " (%dx%d@%.3fHz)", mode->width, mode->height,
+						(float)mode->refresh / 1000);
+				} else {
+					fprintf(f, " (unsupported)");
+				}
+			} else {
+				const char *note = "";
+				if (mode == NULL) {
+					note = settings->mode.custom ?
+						" (custom)" : " (unsupported)";
+				}
+				fprintf(f, ", mode %dx%d@%.3fHz%s",
+					settings->mode.width, settings->mode.height,
+					(float)settings->mode.refresh / 1000, note);
+			}
+		}
+		if (settings->fields & KANSHI_OUTPUT_POSITION) {
+			fprintf(f, ", position %d,%d",
+				settings->position.x, settings->position.y);
+		}
+		if (settings->fields & KANSHI_OUTPUT_SCALE) {
+			fprintf(f, ", scale %f", settings->scale);
+		}
+		if (settings->fields & KANSHI_OUTPUT_TRANSFORM) {
+			fprintf(f, ", transform %s",
+				kanshi_transform_str(settings->transform));
+		}
+		if (settings->fields & KANSHI_OUTPUT_ADAPTIVE_SYNC) {
+			fprintf(f, ", adaptive_sync %s",
+				settings->adaptive_sync ? "on" : "off");
+		}
+		fprintf(f, "\n");
+	}
 }
 
+static const struct zwlr_output_configuration_v1_listener config_listener;
+
+// Builds the configuration of a pending profile and sends it for testing or
+// applying, depending on its type
+static bool send_configuration(struct kanshi_state *state,
+		struct kanshi_pending_profile *pending) {
+	if (state->output_manager == NULL) {
+		kanshi_log(KANSHI_LOG_ERROR, "not connected to the compositor");
+		return false;
+	}
+	struct zwlr_output_configuration_v1 *config =
+		zwlr_output_manager_v1_create_configuration(state->output_manager,
+		pending->serial);
+	zwlr_output_configuration_v1_add_listener(config, &config_listener, pending);
+	pending->config = config;
+
+	ssize_t i = -1;
+	struct kanshi_head *head;
+	wl_list_for_each(head, &state->heads, link) {
+		i++;
+		struct kanshi_profile_output *profile_output = pending->matches[i];
+		if (profile_output == NULL) {
+			// Not part of a partial profile, every head needs to be
+			// configured though
+			if (head->enabled) {
+				// Keeps the current settings of the head
+				zwlr_output_configuration_head_v1_destroy(
+					zwlr_output_configuration_v1_enable_head(config,
+					head->wlr_head));
+			} else {
+				zwlr_output_configuration_v1_disable_head(config,
+					head->wlr_head);
+			}
+			continue;
+		}
+
+		kanshi_log(KANSHI_LOG_DEBUG, "applying profile output '%s' on connected head '%s'",
+			profile_output->name, head->name);
+		const struct kanshi_output_settings *settings =
+			profile_output->settings;
+
+		bool enabled = head->enabled;
+		if (settings->fields & KANSHI_OUTPUT_ENABLED) {
+			enabled = settings->enabled;
+		}
+
+		if (!enabled) {
+			zwlr_output_configuration_v1_disable_head(config, head->wlr_head);
+			continue;
+		}
+
+		struct zwlr_output_configuration_head_v1 *config_head =
+			zwlr_output_configuration_v1_enable_head(config, head->wlr_head);
+		if (settings->fields & KANSHI_OUTPUT_MODE) {
+			struct kanshi_mode *mode = kanshi_select_mode(head, settings);
+			if (mode == NULL && settings->mode.custom) {
+				zwlr_output_configuration_head_v1_set_custom_mode(config_head,
+					settings->mode.width, settings->mode.height,
+					settings->mode.refresh);
+			} else if (mode == NULL) {
+				if (settings->mode.policy != KANSHI_MODE_EXACT) {
+					kanshi_log(KANSHI_LOG_ERROR, "output '%s' has no %s mode",
+						head->name, mode_policy_str(settings->mode.policy));
+				} else {
+					kanshi_log(KANSHI_LOG_ERROR,
+						"output '%s' doesn't support mode '%dx%d@%fHz'",
+						head->name,
+						settings->mode.width, settings->mode.height,
+						(float)settings->mode.refresh / 1000);
+				}
+				zwlr_output_configuration_head_v1_destroy(config_head);
+				zwlr_output_configuration_v1_destroy(config);
+				return false;
+			} else {
+				zwlr_output_configuration_head_v1_set_mode(config_head,
+					mode->wlr_mode);
+			}
+		}
+		if (settings->fields & KANSHI_OUTPUT_POSITION) {
+			zwlr_output_configuration_head_v1_set_position(config_head,
+				settings->position.x, settings->position.y);
+		}
+		if (settings->fields & KANSHI_OUTPUT_SCALE) {
+			zwlr_output_configuration_head_v1_set_scale(config_head,
+				wl_fixed_from_double(settings->scale));
+		}
+		if (settings->fields & KANSHI_OUTPUT_TRANSFORM) {
+			zwlr_output_configuration_head_v1_set_transform(config_head,
+				settings->transform);
+		}
+		if (settings->fields & KANSHI_OUTPUT_ADAPTIVE_SYNC) {
+			if (zwlr_output_configuration_head_v1_get_version(config_head) >=
+					ZWLR_OUTPUT_CONFIGURATION_HEAD_V1_SET_ADAPTIVE_SYNC_SINCE_VERSION) {
+				zwlr_output_configuration_head_v1_set_adaptive_sync(
+					config_head, settings->adaptive_sync ?
+					ZWLR_OUTPUT_HEAD_V1_ADAPTIVE_SYNC_STATE_ENABLED :
+					ZWLR_OUTPUT_HEAD_V1_ADAPTIVE_SYNC_STATE_DISABLED);
+			} else {
+				kanshi_log(KANSHI_LOG_ERROR, "compositor doesn't support adaptive sync, "
+					"ignoring it for output '%s'", head->name);
+			}
+		}
+		// The protocol object lives as long as the configuration
+		zwlr_output_configuration_head_v1_destroy(config_head);
+	}
+
+	bool test = pending->type != KANSHI_PENDING_APPLY;
+	kanshi_trace_configuration(state, config, pending->profile, test);
+	if (test) {
+		zwlr_output_configuration_v1_test(config);
+	} else {
+		zwlr_output_configuration_v1_apply(config);
+	}
+	return true;
+}
+
+static struct kanshi_pending_profile *create_pending_profile(
+		struct kanshi_state *state, struct kanshi_profile *profile,
+		struct kanshi_profile_output **matches,
+		enum kanshi_pending_type type) {
+	struct kanshi_pending_profile *pending = calloc(1, sizeof(*pending));
+	if (pending == NULL) {
+		return NULL;
+	}
+	pending->state = state;
+	pending->profile = profile;
+	pending->type = type;
+	pending->serial = state->serial;
+	memcpy(pending->matches, matches, sizeof(pending->matches));
+	wl_list_insert(&state->pending_profiles, &pending->link);
+	return pending;
+}
+
+static void destroy_pending_profile(struct kanshi_pending_profile *pending) {
+	wl_list_remove(&pending->link);
+	free(pending);
+}
+
+// Returns false if the command couldn't be executed
+static bool exec_command(char *cmd) {
+	// Closed on exec, the grandchild writes to it if exec fails
+	int exec_fds[2];
+	if (pipe(exec_fds) != 0) {
+		kanshi_log(KANSHI_LOG_ERROR, "pipe failed: %s", strerror(errno));
+		return false;
+	}
+	for (size_t i = 0; i < 2; i++) {
+		fcntl(exec_fds[i], F_SETFD, FD_CLOEXEC);
+	}
 
-static void exec_command(char *cmd) {
 	pid_t child, grandchild;
 	// Fork process
 	if ((child = fork()) == 0) {
@@ -97,10 +454,17 @@ static void exec_command(char *cmd) {
 		sigaction(SIGQUIT, &action, NULL);
 		sigaction(SIGTERM, &action, NULL);
 		sigaction(SIGHUP, &action, NULL);
+		sigaction(SIGUSR1, &action, NULL);
 
 		if ((grandchild = fork()) == 0) {
+			close(exec_fds[0]);
 			execl("/bin/sh", "/bin/sh", "-c", cmd, (void *)NULL);
 			fprintf(stderr, "Executing command '%s' failed: %s\n", cmd, strerror(errno));
+			// Without this, the child process can't tell from a
+			// successful exec
+			if (write(exec_fds[1], "", 1) != 1) {
+				_exit(1);
+			}
 			_exit(-1);
 		}
 		if (grandchild < 0) {
@@ -108,57 +472,340 @@ static void exec_command(char *cmd) {
 					" command '%s': %s\n", cmd, strerror(errno));
 			_exit(1);
 		}
-		_exit(0); // Close child process
+		// Wait for exec, the pipe is only written to if it failed
+		close(exec_fds[1]);
+		char buf;
+		ssize_t n;
+		do {
+			n = read(exec_fds[0], &buf, 1);
+		} while (n < 0 && errno == EINTR);
+		_exit(n == 0 ? 0 : 1); // Close child process
 	}
+	close(exec_fds[0]);
+	close(exec_fds[1]);
+	KANSHI_PROBE2(exec_spawn, cmd, child);
 
 	if (child < 0) {
-		perror("Impossible to fork a new process");
-		return;
+		kanshi_log(KANSHI_LOG_ERROR, "Impossible to fork a new process: %s",
+			strerror(errno));
+		return false;
 	}
 
 	// cleanup child process
-	if (waitpid(child, NULL, 0) < 0) {
-		perror("Impossible to clean up child process");
+	int status;
+	if (waitpid(child, &status, 0) < 0) {
+		kanshi_log(KANSHI_LOG_ERROR, "Impossible to clean up child process: %s",
+			strerror(errno));
+		return false;
 	}
+	bool ok = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+	KANSHI_PROBE3(exec_exit, cmd, child, ok);
+	return ok;
 }
 
-static void execute_profile_commands(struct kanshi_profile *profile) {
+static void execute_profile_commands(struct kanshi_state *state,
+		struct kanshi_profile *profile) {
+	if (kanshi_trace_is_replay(state)) {
+		return;
+	}
+
 	struct kanshi_profile_command *command;
 	wl_list_for_each(command, &profile->commands, link) {
-		fprintf(stderr, "Running command '%s'\n", command->command);
-		exec_command(command->command);
+		kanshi_log(KANSHI_LOG_DEBUG, "Running command '%s'", command->command);
+		struct timespec start;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		if (!exec_command(command->command)) {
+			state->metrics.exec_failures++;
+		}
+		kanshi_metrics_observe(state, KANSHI_DURATION_EXEC, &start);
+	}
+}
+
+// The profile of a pending configuration is reset when it is destroyed, e.g.
+// on reload, or when it is abandoned after a timeout
+static bool pending_profile_outdated(struct kanshi_pending_profile *pending,
+		const char *outcome) {
+	if (pending->profile != NULL) {
+		return false;
+	}
+	kanshi_log(KANSHI_LOG_DEBUG, "outdated configuration %s", outcome);
+	return true;
+}
+
+static void test_finished(struct kanshi_pending_profile *pending,
+		enum kanshi_event_type type) {
+	struct kanshi_state *state = pending->state;
+	send_event(state, type, pending->profile, NULL);
+	if (pending->type == KANSHI_PENDING_TEST_ONLY && state->dry_run) {
+		state->dry_run_accepted = type == KANSHI_EVENT_TEST_SUCCEEDED;
+	}
+}
+
+static void arm_timer(struct kanshi_state *state,
+		enum kanshi_timer_type type, int msec) {
+	state->timer = type;
+	if (type == KANSHI_TIMER_NONE) {
+		msec = 0;
+	}
+	if (kanshi_trace_is_replay(state)) {
+		kanshi_replay_set_timer(state, type == KANSHI_TIMER_NONE ? -1 : msec);
+		return;
+	}
+	struct itimerspec spec = {
+		.it_value = {
+			.tv_sec = msec / 1000,
+			.tv_nsec = (long)(msec % 1000) * 1000000,
+		},
+	};
+	if (timerfd_settime(state->timer_fd, 0, &spec, NULL) != 0) {
+		kanshi_log(KANSHI_LOG_ERROR, "timerfd_settime failed: %s",
+			strerror(errno));
+	}
+}
+
+// A transaction is the configuration of a profile being applied: it starts
+// when the configuration is sent and ends when the compositor has answered
+// or the timeout has expired. Only one transaction is in flight at a time.
+static void start_transaction(struct kanshi_state *state,
+		struct kanshi_pending_profile *pending) {
+	state->transaction = pending;
+	state->pending_profile = pending->profile;
+	pending->id = ++state->transactions;
+	clock_gettime(CLOCK_MONOTONIC, &state->transaction_start);
+	arm_timer(state, KANSHI_TIMER_TIMEOUT, TRANSACTION_TIMEOUT_MS);
+}
+
+static void end_transaction(struct kanshi_state *state,
+		struct kanshi_pending_profile *pending) {
+	if (state->transaction != pending) {
+		return;
+	}
+	state->transaction = NULL;
+	state->pending_profile = NULL;
+	kanshi_metrics_observe(state, KANSHI_DURATION_TRANSACTION,
+		&state->transaction_start);
+	if (state->timer == KANSHI_TIMER_TIMEOUT) {
+		arm_timer(state, KANSHI_TIMER_NONE, 0);
+	}
+}
+
+static enum kanshi_apply_result reapply(struct kanshi_state *state);
+static void try_reconnect(struct kanshi_state *state);
+
+// Picks a profile again if the outputs or the requested profile changed
+// while the last transaction was in flight
+static void finish_transaction(struct kanshi_state *state) {
+	if (state->transaction != NULL || !state->superseded) {
+		return;
+	}
+	state->superseded = false;
+	kanshi_log(KANSHI_LOG_INFO, "configuration superseded, picking a profile again");
+	reapply(state);
+}
+
+static enum kanshi_apply_result apply_next_candidate(
+	struct kanshi_state *state);
+
+// Falls back to the next candidate when a profile applied automatically
+// couldn't be applied, transaction is 0 if the configuration wasn't sent
+static enum kanshi_apply_result fail_profile(struct kanshi_state *state,
+		struct kanshi_profile *profile, uint32_t serial,
+		uint32_t transaction) {
+	state->retries = 0;
+	bool fallback = !state->superseded &&
+		serial == state->candidates_serial &&
+		state->next_candidate > 0 &&
+		state->next_candidate < state->candidates_len &&
+		state->candidates[state->next_candidate - 1].profile == profile;
+	if (!fallback) {
+		send_outcome(state, KANSHI_EVENT_APPLY_FAILED, profile, transaction);
+		return KANSHI_APPLY_FAILED;
+	}
+	kanshi_log(KANSHI_LOG_INFO, "skipping profile '%s', trying the next matching one",
+		profile->name);
+	send_event(state, KANSHI_EVENT_PROFILE_SKIPPED, profile, NULL);
+	enum kanshi_apply_result result = apply_next_candidate(state);
+	kanshi_ipc_apply_done(state, result);
+	return result;
+}
+
+// Compositors don't necessarily advertise custom modes, remember the ones
+// which got applied
+static void update_custom_modes(struct kanshi_state *state,
+		struct kanshi_pending_profile *pending) {
+	ssize_t i = -1;
+	struct kanshi_head *head;
+	wl_list_for_each(head, &state->heads, link) {
+		i++;
+		struct kanshi_profile_output *profile_output = pending->matches[i];
+		if (profile_output == NULL) {
+			continue;
+		}
+		const struct kanshi_output_settings *settings =
+			profile_output->settings;
+		if (!(settings->fields & KANSHI_OUTPUT_MODE) ||
+				!settings->mode.custom ||
+				kanshi_select_mode(head, settings) != NULL) {
+			continue;
+		}
+		head->custom_mode.width = settings->mode.width;
+		head->custom_mode.height = settings->mode.height;
+		head->custom_mode.refresh = settings->mode.refresh;
 	}
 }
 
 static void config_handle_succeeded(void *data,
 		struct zwlr_output_configuration_v1 *config) {
 	struct kanshi_pending_profile *pending = data;
+	struct kanshi_state *state = pending->state;
+	kanshi_trace_event(state, config, "config.succeeded");
+	KANSHI_PROBE2(config_succeeded,
+		pending->profile != NULL ? pending->profile->name : NULL,
+		pending->type);
 	zwlr_output_configuration_v1_destroy(config);
-	fprintf(stderr, "running commands for configuration '%s'\n", pending->profile->name);
-	execute_profile_commands(pending->profile);
-	fprintf(stderr, "configuration for profile '%s' applied\n",
+	if (pending_profile_outdated(pending, "succeeded")) {
+		if (pending->type == KANSHI_PENDING_APPLY) {
+			// What got applied doesn't belong to a known profile anymore
+			state->current_profile = NULL;
+		}
+		end_transaction(state, pending);
+		send_outcome(state, pending->type == KANSHI_PENDING_APPLY ?
+			KANSHI_EVENT_APPLY_SUCCEEDED : KANSHI_EVENT_APPLY_CANCELLED,
+			NULL, pending->id);
+		destroy_pending_profile(pending);
+		finish_transaction(state);
+		return;
+	}
+
+	if (pending->type != KANSHI_PENDING_APPLY) {
+		kanshi_log(KANSHI_LOG_INFO, "configuration for profile '%s' passed the test",
 			pending->profile->name);
-	pending->state->current_profile = pending->profile;
-	free(pending);
+		test_finished(pending, KANSHI_EVENT_TEST_SUCCEEDED);
+		if (pending->type == KANSHI_PENDING_TEST_ONLY) {
+			destroy_pending_profile(pending);
+			return;
+		}
+
+		if (state->superseded) {
+			// No need to apply a configuration about to be replaced
+			end_transaction(state, pending);
+			destroy_pending_profile(pending);
+			finish_transaction(state);
+			return;
+		}
+		pending->type = KANSHI_PENDING_APPLY;
+		if (!send_configuration(state, pending)) {
+			struct kanshi_profile *profile = pending->profile;
+			uint32_t serial = pending->serial, id = pending->id;
+			end_transaction(state, pending);
+			destroy_pending_profile(pending);
+			fail_profile(state, profile, serial, id);
+			finish_transaction(state);
+		}
+		return;
+	}
+
+	end_transaction(state, pending);
+	state->retries = 0;
+	kanshi_log(KANSHI_LOG_DEBUG, "running commands for configuration '%s'",
+		pending->profile->name);
+	execute_profile_commands(state, pending->profile);
+	kanshi_log(KANSHI_LOG_INFO, "configuration for profile '%s' applied",
+			pending->profile->name);
+	state->current_profile = pending->profile;
+	update_custom_modes(state, pending);
+	if (state->restore) {
+		kanshi_save_layout(state, pending->profile, pending->matches);
+	}
+	send_outcome(state, KANSHI_EVENT_APPLY_SUCCEEDED, pending->profile,
+		pending->id);
+	destroy_pending_profile(pending);
+	finish_transaction(state);
 }
 
 static void config_handle_failed(void *data,
 		struct zwlr_output_configuration_v1 *config) {
 	struct kanshi_pending_profile *pending = data;
+	struct kanshi_state *state = pending->state;
+	kanshi_trace_event(state, config, "config.failed");
+	KANSHI_PROBE2(config_failed,
+		pending->profile != NULL ? pending->profile->name : NULL,
+		pending->type);
 	zwlr_output_configuration_v1_destroy(config);
-	fprintf(stderr, "failed to apply configuration for profile '%s'\n",
+	end_transaction(state, pending);
+	if (pending_profile_outdated(pending, "failed")) {
+		send_outcome(state, KANSHI_EVENT_APPLY_FAILED, NULL, pending->id);
+		destroy_pending_profile(pending);
+		finish_transaction(state);
+		return;
+	}
+	if (pending->type != KANSHI_PENDING_APPLY) {
+		kanshi_log(KANSHI_LOG_ERROR, "compositor rejected the configuration for "
+			"profile '%s'", pending->profile->name);
+		test_finished(pending, KANSHI_EVENT_TEST_FAILED);
+		if (pending->type == KANSHI_PENDING_TEST_ONLY) {
+			destroy_pending_profile(pending);
+			return;
+		}
+	}
+	kanshi_log(KANSHI_LOG_ERROR, "failed to apply configuration for profile '%s'",
 			pending->profile->name);
-	free(pending);
+	struct kanshi_profile *profile = pending->profile;
+	uint32_t serial = pending->serial, id = pending->id;
+	destroy_pending_profile(pending);
+	fail_profile(state, profile, serial, id);
+	finish_transaction(state);
 }
 
 static void config_handle_cancelled(void *data,
 		struct zwlr_output_configuration_v1 *config) {
 	struct kanshi_pending_profile *pending = data;
+	struct kanshi_state *state = pending->state;
+	kanshi_trace_event(state, config, "config.cancelled");
+	KANSHI_PROBE2(config_cancelled,
+		pending->profile != NULL ? pending->profile->name : NULL,
+		pending->type);
 	zwlr_output_configuration_v1_destroy(config);
-	// Wait for new serial
-	fprintf(stderr, "configuration for profile '%s' cancelled, retrying\n",
-			pending->profile->name);
-	free(pending);
+	end_transaction(state, pending);
+	if (pending_profile_outdated(pending, "cancelled")) {
+		send_outcome(state, KANSHI_EVENT_APPLY_CANCELLED, NULL, pending->id);
+		destroy_pending_profile(pending);
+		finish_transaction(state);
+		return;
+	}
+	if (pending->type != KANSHI_PENDING_APPLY) {
+		test_finished(pending, KANSHI_EVENT_TEST_CANCELLED);
+		if (pending->type == KANSHI_PENDING_TEST_ONLY) {
+			kanshi_log(KANSHI_LOG_INFO, "test of profile '%s' cancelled",
+				pending->profile->name);
+			destroy_pending_profile(pending);
+			return;
+		}
+	}
+
+	struct kanshi_profile *profile = pending->profile;
+	uint32_t id = pending->id;
+	destroy_pending_profile(pending);
+	if (state->superseded) {
+		kanshi_log(KANSHI_LOG_INFO, "configuration for profile '%s' cancelled",
+			profile->name);
+		send_outcome(state, KANSHI_EVENT_APPLY_CANCELLED, profile, id);
+		finish_transaction(state);
+	} else if (state->retries < MAX_RETRIES) {
+		// The output state changed under our feet, try again once it
+		// settles
+		int delay = RETRY_DELAY_MS << state->retries;
+		state->retries++;
+		kanshi_log(KANSHI_LOG_INFO, "configuration for profile '%s' cancelled, "
+			"retrying in %d ms", profile->name, delay);
+		send_event(state, KANSHI_EVENT_APPLY_RETRYING, profile, NULL);
+		arm_timer(state, KANSHI_TIMER_RETRY, delay);
+	} else {
+		kanshi_log(KANSHI_LOG_ERROR, "configuration for profile '%s' cancelled %d times, "
+			"giving up", profile->name, state->retries + 1);
+		state->retries = 0;
+		send_outcome(state, KANSHI_EVENT_APPLY_CANCELLED, profile, id);
+	}
 }
 
 static const struct zwlr_output_configuration_v1_listener config_listener = {
@@ -167,116 +814,162 @@ static const struct zwlr_output_configuration_v1_listener config_listener = {
 	.cancelled = config_handle_cancelled,
 };
 
-static bool match_refresh(const struct kanshi_mode *mode, int refresh) {
-	int v = refresh - mode->refresh;
-	return abs(v) < 50;
+static void handle_timeout(struct kanshi_state *state) {
+	struct kanshi_pending_profile *pending = state->transaction;
+	if (pending == NULL) {
+		return;
+	}
+	struct kanshi_profile *profile = pending->profile;
+	uint32_t serial = pending->serial;
+	end_transaction(state, pending);
+	// An answer coming after the timeout is ignored
+	pending->profile = NULL;
+	if (profile == NULL) {
+		send_outcome(state, KANSHI_EVENT_APPLY_FAILED, NULL, pending->id);
+		finish_transaction(state);
+		return;
+	}
+	kanshi_log(KANSHI_LOG_ERROR, "compositor didn't answer the configuration for profile "
+		"'%s' within %d ms", profile->name, TRANSACTION_TIMEOUT_MS);
+	fail_profile(state, profile, serial, pending->id);
+	finish_transaction(state);
 }
 
-static struct kanshi_mode *match_mode(struct kanshi_head *head,
-		int width, int height, int refresh) {
-	struct kanshi_mode *mode;
-	struct kanshi_mode *last_match = NULL;
-
-	wl_list_for_each(mode, &head->modes, link) {
-		if (mode->width != width || mode->height != height) {
-			continue;
-		}
-
-		if (refresh) {
-			if (match_refresh(mode, refresh)) {
-				return mode;
-			}
-		} else {
-			if (!last_match || mode->refresh > last_match->refresh) {
-				last_match = mode;
-			}
+void kanshi_handle_timer(struct kanshi_state *state) {
+	enum kanshi_timer_type timer = state->timer;
+	state->timer = KANSHI_TIMER_NONE;
+	switch (timer) {
+	case KANSHI_TIMER_NONE:
+		break;
+	case KANSHI_TIMER_TIMEOUT:
+		handle_timeout(state);
+		break;
+	case KANSHI_TIMER_RETRY:
+		// Without a config yet, profiles are picked once it's installed
+		if (state->transaction == NULL && state->daemon->config != NULL) {
+			reapply(state);
 		}
+		break;
+	case KANSHI_TIMER_RECONNECT:
+		try_reconnect(state);
+		break;
 	}
+}
 
-	return last_match;
+// The layout restored on startup is still in place and is the one the
+// matches resolve to, no need to configure the heads again
+static bool restored_layout_applied(struct kanshi_state *state,
+		struct kanshi_profile_output **matches) {
+	if (state->restored_config == NULL || state->current_profile == NULL ||
+			wl_list_empty(&state->restored_config->profiles)) {
+		return false;
+	}
+	struct kanshi_profile *restored = wl_container_of(
+		state->restored_config->profiles.next, restored, link);
+	struct kanshi_profile_output *restored_matches[HEADS_MAX];
+	return state->current_profile == restored &&
+		kanshi_match_profile(state, restored, restored_matches) &&
+		kanshi_same_layout(state, restored_matches, matches);
 }
 
-static void apply_profile(struct kanshi_state *state,
+static enum kanshi_apply_result apply_profile(struct kanshi_state *state,
 		struct kanshi_profile *profile,
 		struct kanshi_profile_output **matches) {
-	if (state->pending_profile == profile || state->current_profile == profile) {
-		return;
+	KANSHI_PROBE2(apply_profile, profile->name, state->serial);
+	if (state->transaction != NULL) {
+		if (state->pending_profile == profile &&
+				state->transaction->serial == state->serial) {
+			return KANSHI_APPLY_UNCHANGED;
+		}
+		// Sending another configuration now would most likely get it
+		// cancelled, wait for the answer to the one in flight
+		kanshi_log(KANSHI_LOG_INFO, "waiting for the configuration in flight before "
+			"applying profile '%s'", profile->name);
+		state->superseded = true;
+		return KANSHI_APPLY_PENDING;
+	}
+	// Outputs plugged since a partial profile was applied still need to be
+	// configured
+	if (state->current_profile == profile && !profile->partial) {
+		return KANSHI_APPLY_UNCHANGED;
+	}
+	if (restored_layout_applied(state, matches)) {
+		kanshi_log(KANSHI_LOG_INFO, "profile '%s' matches the restored layout",
+			profile->name);
+		execute_profile_commands(state, profile);
+		state->current_profile = profile;
+		kanshi_save_layout(state, profile, matches);
+		send_event(state, KANSHI_EVENT_APPLY_SUCCEEDED, profile, NULL);
+		return KANSHI_APPLY_UNCHANGED;
 	}
 
-	fprintf(stderr, "applying profile '%s'\n", profile->name);
-
-	struct kanshi_pending_profile *pending = calloc(1, sizeof(*pending));
-	pending->state = state;
-	pending->profile = profile;
-	state->pending_profile = profile;
-
-	struct zwlr_output_configuration_v1 *config =
-		zwlr_output_manager_v1_create_configuration(state->output_manager,
-		state->serial);
-	zwlr_output_configuration_v1_add_listener(config, &config_listener, pending);
-
-	ssize_t i = -1;
-	struct kanshi_head *head;
-	wl_list_for_each(head, &state->heads, link) {
-		i++;
-		struct kanshi_profile_output *profile_output = matches[i];
-
-		fprintf(stderr, "applying profile output '%s' on connected head '%s'\n",
-			profile_output->name, head->name);
+	kanshi_log(KANSHI_LOG_INFO, "applying profile '%s'", profile->name);
 
-		bool enabled = head->enabled;
-		if (profile_output->fields & KANSHI_OUTPUT_ENABLED) {
-			enabled = profile_output->enabled;
+	struct kanshi_pending_profile *pending = create_pending_profile(state,
+		profile, matches, state->test_first ?
+		KANSHI_PENDING_TEST_FIRST : KANSHI_PENDING_APPLY);
+	if (pending == NULL || !send_configuration(state, pending)) {
+		if (pending != NULL) {
+			destroy_pending_profile(pending);
 		}
+		return fail_profile(state, profile, state->serial, 0);
+	}
+	start_transaction(state, pending);
+	send_event(state, KANSHI_EVENT_APPLY_STARTED, profile, NULL);
+	return KANSHI_APPLY_PENDING;
+}
 
-		if (!enabled) {
-			zwlr_output_configuration_v1_disable_head(config, head->wlr_head);
-			continue;
-		}
+static enum kanshi_apply_result apply_next_candidate(
+		struct kanshi_state *state) {
+	assert(state->next_candidate < state->candidates_len);
+	struct kanshi_candidate *candidate =
+		&state->candidates[state->next_candidate];
+	state->next_candidate++;
+	if (candidate->profile != state->current_profile &&
+			candidate->profile != state->pending_profile) {
+		send_event(state, KANSHI_EVENT_PROFILE_MATCHED, candidate->profile,
+			NULL);
+	}
+	return apply_profile(state, candidate->profile, candidate->matches);
+}
 
-		struct zwlr_output_configuration_head_v1 *config_head =
-			zwlr_output_configuration_v1_enable_head(config, head->wlr_head);
-		if (profile_output->fields & KANSHI_OUTPUT_MODE) {
-			// TODO: support custom modes
-			struct kanshi_mode *mode = match_mode(head,
-				profile_output->mode.width, profile_output->mode.height,
-				profile_output->mode.refresh);
-			if (mode == NULL) {
-				fprintf(stderr,
-					"output '%s' doesn't support mode '%dx%d@%fHz'\n",
-					head->name,
-					profile_output->mode.width, profile_output->mode.height,
-					(float)profile_output->mode.refresh / 1000);
-				goto error;
-			}
-			zwlr_output_configuration_head_v1_set_mode(config_head,
-				mode->wlr_mode);
-		}
-		if (profile_output->fields & KANSHI_OUTPUT_POSITION) {
-			zwlr_output_configuration_head_v1_set_position(config_head,
-				profile_output->position.x, profile_output->position.y);
-		}
-		if (profile_output->fields & KANSHI_OUTPUT_SCALE) {
-			zwlr_output_configuration_head_v1_set_scale(config_head,
-				wl_fixed_from_double(profile_output->scale));
-		}
-		if (profile_output->fields & KANSHI_OUTPUT_TRANSFORM) {
-			zwlr_output_configuration_head_v1_set_transform(config_head,
-				profile_output->transform);
-		}
+enum kanshi_apply_result kanshi_test_profile(struct kanshi_state *state,
+		struct kanshi_profile *profile) {
+	assert(wl_list_length(&state->heads) <= HEADS_MAX);
+	struct kanshi_profile_output *matches[HEADS_MAX];
+	if (!kanshi_match_profile(state, profile, matches)) {
+		return KANSHI_APPLY_NO_MATCH;
 	}
 
-	zwlr_output_configuration_v1_apply(config);
-	return;
+	kanshi_log(KANSHI_LOG_INFO, "testing profile '%s'", profile->name);
 
-error:
-	zwlr_output_configuration_v1_destroy(config);
+	struct kanshi_pending_profile *pending = create_pending_profile(state,
+		profile, matches, KANSHI_PENDING_TEST_ONLY);
+	if (pending == NULL || !send_configuration(state, pending)) {
+		if (pending != NULL) {
+			destroy_pending_profile(pending);
+		}
+		return KANSHI_APPLY_FAILED;
+	}
+	return KANSHI_APPLY_PENDING;
 }
 
+bool kanshi_describe_profile(struct kanshi_state *state,
+		struct kanshi_profile *profile, FILE *f) {
+	assert(wl_list_length(&state->heads) <= HEADS_MAX);
+	struct kanshi_profile_output *matches[HEADS_MAX];
+	if (!kanshi_match_profile(state, profile, matches)) {
+		return false;
+	}
+	describe_configuration(state, matches, f);
+	return true;
+}
 
 static void mode_handle_size(void *data, struct zwlr_output_mode_v1 *wlr_mode,
 		int32_t width, int32_t height) {
 	struct kanshi_mode *mode = data;
+	kanshi_trace_event(mode->head->state, wlr_mode, "mode.size %d %d",
+		width, height);
 	mode->width = width;
 	mode->height = height;
 }
@@ -284,21 +977,33 @@ static void mode_handle_size(void *data, struct zwlr_output_mode_v1 *wlr_mode,
 static void mode_handle_refresh(void *data,
 		struct zwlr_output_mode_v1 *wlr_mode, int32_t refresh) {
 	struct kanshi_mode *mode = data;
+	kanshi_trace_event(mode->head->state, wlr_mode, "mode.refresh %d", refresh);
 	mode->refresh = refresh;
 }
 
 static void mode_handle_preferred(void *data,
 		struct zwlr_output_mode_v1 *wlr_mode) {
 	struct kanshi_mode *mode = data;
+	kanshi_trace_event(mode->head->state, wlr_mode, "mode.preferred");
 	mode->preferred = true;
 }
 
+static void destroy_mode(struct kanshi_mode *mode) {
+	wl_list_remove(&mode->link);
+	if (zwlr_output_mode_v1_get_version(mode->wlr_mode) >=
+			ZWLR_OUTPUT_MODE_V1_RELEASE_SINCE_VERSION) {
+		zwlr_output_mode_v1_release(mode->wlr_mode);
+	} else {
+		zwlr_output_mode_v1_destroy(mode->wlr_mode);
+	}
+	free(mode);
+}
+
 static void mode_handle_finished(void *data,
 		struct zwlr_output_mode_v1 *wlr_mode) {
 	struct kanshi_mode *mode = data;
-	wl_list_remove(&mode->link);
-	zwlr_output_mode_v1_destroy(mode->wlr_mode);
-	free(mode);
+	kanshi_trace_event(mode->head->state, wlr_mode, "mode.finished");
+	destroy_mode(mode);
 }
 
 static const struct zwlr_output_mode_v1_listener mode_listener = {
@@ -311,18 +1016,23 @@ static const struct zwlr_output_mode_v1_listener mode_listener = {
 static void head_handle_name(void *data,
 		struct zwlr_output_head_v1 *wlr_head, const char *name) {
 	struct kanshi_head *head = data;
+	kanshi_trace_event(head->state, wlr_head, "head.name %s", name);
 	head->name = strdup(name);
 }
 
 static void head_handle_description(void *data,
 		struct zwlr_output_head_v1 *wlr_head, const char *description) {
 	struct kanshi_head *head = data;
+	kanshi_trace_event(head->state, wlr_head, "head.description %s",
+		description);
 	head->description = strdup(description);
 }
 
 static void head_handle_physical_size(void *data,
 		struct zwlr_output_head_v1 *wlr_head, int32_t width, int32_t height) {
 	struct kanshi_head *head = data;
+	kanshi_trace_event(head->state, wlr_head, "head.physical_size %d %d",
+		width, height);
 	head->phys_width = width;
 	head->phys_height = height;
 }
@@ -331,6 +1041,8 @@ static void head_handle_mode(void *data,
 		struct zwlr_output_head_v1 *wlr_head,
 		struct zwlr_output_mode_v1 *wlr_mode) {
 	struct kanshi_head *head = data;
+	kanshi_trace_event(head->state, wlr_head, "head.mode %u",
+		wl_proxy_get_id((struct wl_proxy *)wlr_mode));
 
 	struct kanshi_mode *mode = calloc(1, sizeof(*mode));
 	mode->head = head;
@@ -343,9 +1055,11 @@ static void head_handle_mode(void *data,
 static void head_handle_enabled(void *data,
 		struct zwlr_output_head_v1 *wlr_head, int32_t enabled) {
 	struct kanshi_head *head = data;
+	kanshi_trace_event(head->state, wlr_head, "head.enabled %d", enabled);
 	head->enabled = !!enabled;
 	if (!enabled) {
 		head->mode = NULL;
+		memset(&head->custom_mode, 0, sizeof(head->custom_mode));
 	}
 }
 
@@ -353,20 +1067,24 @@ static void head_handle_current_mode(void *data,
 		struct zwlr_output_head_v1 *wlr_head,
 		struct zwlr_output_mode_v1 *wlr_mode) {
 	struct kanshi_head *head = data;
+	kanshi_trace_event(head->state, wlr_head, "head.current_mode %u",
+		wl_proxy_get_id((struct wl_proxy *)wlr_mode));
 	struct kanshi_mode *mode;
 	wl_list_for_each(mode, &head->modes, link) {
 		if (mode->wlr_mode == wlr_mode) {
 			head->mode = mode;
+			memset(&head->custom_mode, 0, sizeof(head->custom_mode));
 			return;
 		}
 	}
-	fprintf(stderr, "received unknown current_mode\n");
+	kanshi_log(KANSHI_LOG_ERROR, "received unknown current_mode");
 	head->mode = NULL;
 }
 
 static void head_handle_position(void *data,
 		struct zwlr_output_head_v1 *wlr_head, int32_t x, int32_t y) {
 	struct kanshi_head *head = data;
+	kanshi_trace_event(head->state, wlr_head, "head.position %d %d", x, y);
 	head->x = x;
 	head->y = y;
 }
@@ -374,25 +1092,79 @@ static void head_handle_position(void *data,
 static void head_handle_transform(void *data,
 		struct zwlr_output_head_v1 *wlr_head, int32_t transform) {
 	struct kanshi_head *head = data;
+	kanshi_trace_event(head->state, wlr_head, "head.transform %d", transform);
 	head->transform = transform;
 }
 
 static void head_handle_scale(void *data,
 		struct zwlr_output_head_v1 *wlr_head, wl_fixed_t scale) {
 	struct kanshi_head *head = data;
+	kanshi_trace_event(head->state, wlr_head, "head.scale %d", scale);
 	head->scale = wl_fixed_to_double(scale);
 }
 
-static void head_handle_finished(void *data,
-		struct zwlr_output_head_v1 *wlr_head) {
+static void head_handle_adaptive_sync(void *data,
+		struct zwlr_output_head_v1 *wlr_head, uint32_t state) {
 	struct kanshi_head *head = data;
+	kanshi_trace_event(head->state, wlr_head, "head.adaptive_sync %u", state);
+	head->adaptive_sync = state == ZWLR_OUTPUT_HEAD_V1_ADAPTIVE_SYNC_STATE_ENABLED;
+}
+
+// Also destroys the modes the compositor hasn't finished yet
+static void destroy_head(struct kanshi_head *head) {
+	struct kanshi_mode *mode, *tmp;
+	wl_list_for_each_safe(mode, tmp, &head->modes, link) {
+		destroy_mode(mode);
+	}
 	wl_list_remove(&head->link);
-	zwlr_output_head_v1_destroy(head->wlr_head);
+	if (zwlr_output_head_v1_get_version(head->wlr_head) >=
+			ZWLR_OUTPUT_HEAD_V1_RELEASE_SINCE_VERSION) {
+		zwlr_output_head_v1_release(head->wlr_head);
+	} else {
+		zwlr_output_head_v1_destroy(head->wlr_head);
+	}
 	free(head->name);
 	free(head->description);
+	free(head->make);
+	free(head->model);
+	free(head->serial_number);
+	free(head->identifier);
 	free(head);
 }
 
+static void head_handle_finished(void *data,
+		struct zwlr_output_head_v1 *wlr_head) {
+	struct kanshi_head *head = data;
+	kanshi_trace_event(head->state, wlr_head, "head.finished");
+	if (head->announced) {
+		send_event(head->state, KANSHI_EVENT_HEAD_REMOVED, NULL, head);
+	}
+	head->state->heads_changed = true;
+	destroy_head(head);
+}
+
+static void head_handle_make(void *data,
+		struct zwlr_output_head_v1 *wlr_head, const char *make) {
+	struct kanshi_head *head = data;
+	kanshi_trace_event(head->state, wlr_head, "head.make %s", make);
+	head->make = strdup(make);
+}
+
+static void head_handle_model(void *data,
+		struct zwlr_output_head_v1 *wlr_head, const char *model) {
+	struct kanshi_head *head = data;
+	kanshi_trace_event(head->state, wlr_head, "head.model %s", model);
+	head->model = strdup(model);
+}
+
+static void head_handle_serial_number(void *data,
+		struct zwlr_output_head_v1 *wlr_head, const char *serial_number) {
+	struct kanshi_head *head = data;
+	kanshi_trace_event(head->state, wlr_head, "head.serial_number %s",
+		serial_number);
+	head->serial_number = strdup(serial_number);
+}
+
 static const struct zwlr_output_head_v1_listener head_listener = {
 	.name = head_handle_name,
 	.description = head_handle_description,
@@ -404,12 +1176,18 @@ static const struct zwlr_output_head_v1_listener head_listener = {
 	.transform = head_handle_transform,
 	.scale = head_handle_scale,
 	.finished = head_handle_finished,
+	.make = head_handle_make,
+	.model = head_handle_model,
+	.serial_number = head_handle_serial_number,
+	.adaptive_sync = head_handle_adaptive_sync,
 };
 
 static void output_manager_handle_head(void *data,
 		struct zwlr_output_manager_v1 *manager,
 		struct zwlr_output_head_v1 *wlr_head) {
 	struct kanshi_state *state = data;
+	kanshi_trace_event(state, manager, "manager.head %u",
+		wl_proxy_get_id((struct wl_proxy *)wlr_head));
 
 	struct kanshi_head *head = calloc(1, sizeof(*head));
 	head->state = state;
@@ -421,30 +1199,216 @@ static void output_manager_handle_head(void *data,
 	zwlr_output_head_v1_add_listener(wlr_head, &head_listener, head);
 }
 
-static bool try_apply_profiles(struct kanshi_state *state) {
+static void clear_candidates(struct kanshi_state *state) {
+	state->candidates_len = 0;
+	state->next_candidate = 0;
+}
+
+// Makes sure the state doesn't reference profiles about to be destroyed
+static void forget_profiles(struct kanshi_state *state,
+		struct kanshi_config *config) {
+	clear_candidates(state);
+	struct kanshi_profile *profile;
+	wl_list_for_each(profile, &config->profiles, link) {
+		if (state->current_profile == profile) {
+			state->current_profile = NULL;
+		}
+		if (state->pending_profile == profile) {
+			state->pending_profile = NULL;
+		}
+		if (state->requested_profile == profile) {
+			state->requested_profile = NULL;
+		}
+		struct kanshi_pending_profile *pending;
+		wl_list_for_each(pending, &state->pending_profiles, link) {
+			if (pending->profile != profile) {
+				continue;
+			}
+			// Answer the waiting test calls now, the compositor's reply
+			// won't be reported anymore
+			if (pending->type != KANSHI_PENDING_APPLY) {
+				test_finished(pending, KANSHI_EVENT_TEST_CANCELLED);
+			}
+			pending->profile = NULL;
+		}
+	}
+}
+
+static void destroy_override(struct kanshi_state *state) {
+	if (state->override_config == NULL) {
+		return;
+	}
+	forget_profiles(state, state->override_config);
+	destroy_config(state->override_config);
+	state->override_config = NULL;
+}
+
+// Collects the profiles matching the current heads, in order of preference
+static bool find_candidates(struct kanshi_state *state) {
 	assert(wl_list_length(&state->heads) <= HEADS_MAX);
-	// matches[i] gives the kanshi_profile_output for the i-th head
+	clear_candidates(state);
+	state->candidates_serial = state->serial;
+
+	size_t n = wl_list_length(&state->daemon->config->profiles);
+	if (n > state->candidates_cap) {
+		struct kanshi_candidate *candidates =
+			realloc(state->candidates, n * sizeof(*candidates));
+		if (candidates == NULL) {
+			kanshi_log(KANSHI_LOG_ERROR, "failed to allocate candidate profiles");
+			return false;
+		}
+		state->candidates = candidates;
+		state->candidates_cap = n;
+	}
+
+	struct kanshi_profile *profile;
+	wl_list_for_each(profile, &state->daemon->config->profiles, link) {
+		struct kanshi_candidate *candidate =
+			&state->candidates[state->candidates_len];
+		if (!kanshi_match_profile(state, profile, candidate->matches)) {
+			continue;
+		}
+		candidate->profile = profile;
+		candidate->specificity = 0;
+		ssize_t i = -1;
+		struct kanshi_head *head;
+		wl_list_for_each(head, &state->heads, link) {
+			i++;
+			if (candidate->matches[i] != NULL) {
+				candidate->specificity +=
+					match_specificity(candidate->matches[i], head);
+			}
+		}
+
+		// Keep the candidates sorted by specificity, profiles declared
+		// first win ties
+		size_t j = state->candidates_len;
+		while (state->best_match && j > 0 &&
+				state->candidates[j - 1].specificity <
+				candidate->specificity) {
+			j--;
+		}
+		if (j < state->candidates_len) {
+			struct kanshi_candidate tmp = *candidate;
+			memmove(&state->candidates[j + 1], &state->candidates[j],
+				(state->candidates_len - j) * sizeof(tmp));
+			state->candidates[j] = tmp;
+		}
+		state->candidates_len++;
+	}
+	return state->candidates_len > 0;
+}
+
+static enum kanshi_apply_result try_apply_profiles(struct kanshi_state *state) {
+	if (state->daemon->config == NULL) {
+		// Still loading with --restore, profiles are picked once the
+		// config is installed
+		return KANSHI_APPLY_NO_MATCH;
+	}
+	KANSHI_PROBE2(match_start, state->serial,
+		wl_list_length(&state->daemon->config->profiles));
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	bool found = find_candidates(state);
+	kanshi_metrics_observe(state, KANSHI_DURATION_MATCH, &start);
+	KANSHI_PROBE2(match_end, state->serial, state->candidates_len);
+	if (!found) {
+		kanshi_log(KANSHI_LOG_INFO, "no profile matched");
+		return KANSHI_APPLY_NO_MATCH;
+	}
+	return apply_next_candidate(state);
+}
+
+// Make, model and serial number are sent once, before the head is first
+// done
+static void set_head_identifier(struct kanshi_head *head) {
+	if (head->make == NULL && head->model == NULL &&
+			head->serial_number == NULL) {
+		return;
+	}
+	const char *parts[] = { head->make, head->model, head->serial_number };
+	size_t len = 0;
+	for (size_t i = 0; i < sizeof(parts) / sizeof(parts[0]); i++) {
+		if (parts[i] == NULL || parts[i][0] == '\0') {
+			parts[i] = "Unknown";
+		}
+		len += strlen(parts[i]) + 1;
+	}
+	head->identifier = malloc(len);
+	if (head->identifier == NULL) {
+		return;
+	}
+	snprintf(head->identifier, len, "%s %s %s", parts[0], parts[1], parts[2]);
+	head->identifier_hash = hash_criteria(head->identifier);
+}
+
+// Applies the layout saved for the connected heads, if any, without waiting
+// for the config
+static void restore_layout(struct kanshi_state *state) {
+	if (state->restore_attempted) {
+		return; // Only once, on startup
+	}
+	state->restore_attempted = true;
+	struct kanshi_config *config = kanshi_load_layout(state);
+	if (config == NULL) {
+		return;
+	}
+	state->restored_config = config;
+
 	struct kanshi_profile_output *matches[HEADS_MAX];
-	struct kanshi_profile *profile = match(state, matches);
-	if (profile != NULL) {
-		apply_profile(state, profile, matches);
-		return true;
+	struct kanshi_profile *profile;
+	wl_list_for_each(profile, &config->profiles, link) {
+		if (kanshi_match_profile(state, profile, matches)) {
+			kanshi_log(KANSHI_LOG_INFO, "restoring the last layout of profile '%s'",
+				profile->name);
+			apply_profile(state, profile, matches);
+			return;
+		}
 	}
-	fprintf(stderr, "no profile matched\n");
-	return false;
 }
 
 static void output_manager_handle_done(void *data,
 		struct zwlr_output_manager_v1 *manager, uint32_t serial) {
 	struct kanshi_state *state = data;
+	kanshi_trace_event(state, manager, "manager.done %u", serial);
+	KANSHI_PROBE2(manager_done, serial, wl_list_length(&state->heads));
 	state->serial = serial;
 
-	try_apply_profiles(state);
+	struct kanshi_head *head;
+	wl_list_for_each(head, &state->heads, link) {
+		if (!head->announced) {
+			set_head_identifier(head);
+			head->announced = true;
+			state->heads_changed = true;
+			send_event(state, KANSHI_EVENT_HEAD_ADDED, NULL, head);
+		}
+	}
+
+	// Only look for a new profile when outputs are plugged or unplugged, so
+	// that a profile applied on request sticks until the next hotplug
+	if (!state->heads_changed) {
+		return;
+	}
+	state->heads_changed = false;
+	if (state->dry_run) {
+		return;
+	}
+	if (state->daemon->config == NULL) {
+		// The config is loaded once the heads are known with --restore
+		restore_layout(state);
+		return;
+	}
+	destroy_override(state);
+	state->requested_profile = NULL;
+	state->retries = 0;
+
+	kanshi_ipc_apply_done(state, try_apply_profiles(state));
 }
 
 static void output_manager_handle_finished(void *data,
 		struct zwlr_output_manager_v1 *manager) {
-	// This space is intentionally left blank
+	struct kanshi_state *state = data;
+	kanshi_trace_event(state, manager, "manager.finished");
 }
 
 static const struct zwlr_output_manager_v1_listener output_manager_listener = {
@@ -458,10 +1422,14 @@ static void registry_handle_global(void *data, struct wl_registry *registry,
 	struct kanshi_state *state = data;
 
 	if (strcmp(interface, zwlr_output_manager_v1_interface.name) == 0) {
+		if (version > OUTPUT_MANAGER_VERSION) {
+			version = OUTPUT_MANAGER_VERSION;
+		}
 		state->output_manager = wl_registry_bind(registry, name,
-			&zwlr_output_manager_v1_interface, 1);
+			&zwlr_output_manager_v1_interface, version);
 		zwlr_output_manager_v1_add_listener(state->output_manager,
 			&output_manager_listener, state);
+		kanshi_trace_event(state, state->output_manager, "bind %u", version);
 	}
 }
 
@@ -475,6 +1443,111 @@ static const struct wl_registry_listener registry_listener = {
 	.global_remove = registry_handle_global_remove,
 };
 
+// Drops everything tied to the connection to the compositor, the config and
+// the IPC service are kept
+static void disconnect_display(struct kanshi_state *state) {
+	struct kanshi_pending_profile *pending, *tmp_pending;
+	wl_list_for_each_safe(pending, tmp_pending, &state->pending_profiles,
+			link) {
+		if (pending->profile != NULL) {
+			if (pending->type != KANSHI_PENDING_APPLY) {
+				test_finished(pending, KANSHI_EVENT_TEST_CANCELLED);
+			}
+			if (pending->type != KANSHI_PENDING_TEST_ONLY) {
+				send_event(state, KANSHI_EVENT_APPLY_CANCELLED,
+					pending->profile, NULL);
+			}
+		}
+		end_transaction(state, pending);
+		zwlr_output_configuration_v1_destroy(pending->config);
+		destroy_pending_profile(pending);
+	}
+	// Nothing gets applied until the compositor is back
+	kanshi_ipc_transaction_done(state, state->transactions + 1,
+		KANSHI_EVENT_APPLY_CANCELLED, NULL);
+
+	struct kanshi_head *head, *tmp_head;
+	wl_list_for_each_safe(head, tmp_head, &state->heads, link) {
+		if (head->announced) {
+			send_event(state, KANSHI_EVENT_HEAD_REMOVED, NULL, head);
+		}
+		destroy_head(head);
+	}
+
+	if (state->output_manager != NULL) {
+		zwlr_output_manager_v1_destroy(state->output_manager);
+		state->output_manager = NULL;
+	}
+	if (state->registry != NULL) {
+		wl_registry_destroy(state->registry);
+		state->registry = NULL;
+	}
+	wl_display_disconnect(state->display);
+	state->display = NULL;
+
+	// The new compositor starts from scratch
+	destroy_override(state);
+	clear_candidates(state);
+	state->current_profile = NULL;
+	state->requested_profile = NULL;
+	state->superseded = false;
+	state->retries = 0;
+	state->heads_changed = false;
+	state->serial = 0;
+	if (state->timer != KANSHI_TIMER_NONE) {
+		arm_timer(state, KANSHI_TIMER_NONE, 0);
+	}
+}
+
+static bool connect_display(struct kanshi_state *state) {
+	state->display = wl_display_connect(state->display_name);
+	if (state->display == NULL) {
+		return false;
+	}
+	state->registry = wl_display_get_registry(state->display);
+	wl_registry_add_listener(state->registry, &registry_listener, state);
+	if (wl_display_roundtrip(state->display) < 0 ||
+			state->output_manager == NULL) {
+		// Heads are only advertised once the output manager is bound
+		disconnect_display(state);
+		return false;
+	}
+	return true;
+}
+
+static const char *compositor_name(struct kanshi_state *state) {
+	return state->display_name != NULL ? state->display_name : "the compositor";
+}
+
+static void try_reconnect(struct kanshi_state *state) {
+	if (state->display != NULL) {
+		return;
+	}
+	if (connect_display(state)) {
+		kanshi_log(KANSHI_LOG_INFO, "reconnected to %s",
+			compositor_name(state));
+		state->reconnect_delay = RECONNECT_DELAY_MS;
+		return;
+	}
+	state->reconnect_delay *= 2;
+	if (state->reconnect_delay > RECONNECT_MAX_DELAY_MS) {
+		state->reconnect_delay = RECONNECT_MAX_DELAY_MS;
+	}
+	kanshi_log(KANSHI_LOG_INFO, "failed to reconnect to %s, retrying in %d ms",
+		compositor_name(state), state->reconnect_delay);
+	arm_timer(state, KANSHI_TIMER_RECONNECT, state->reconnect_delay);
+}
+
+void kanshi_handle_disconnect(struct kanshi_state *state) {
+	int err = wl_display_get_error(state->display);
+	kanshi_log(KANSHI_LOG_ERROR, "lost the connection to %s (%s), reconnecting",
+		compositor_name(state), strerror(err));
+	disconnect_display(state);
+	state->reconnect_delay = RECONNECT_DELAY_MS;
+	// The compositor is most likely still restarting
+	arm_timer(state, KANSHI_TIMER_RECONNECT, state->reconnect_delay);
+}
+
 static struct kanshi_config *read_config(const char *config) {
 	if (config != NULL) {
 		return parse_config(config);
@@ -491,59 +1564,394 @@ static struct kanshi_config *read_config(const char *config) {
 		snprintf(config_path, sizeof(config_path), "%s/.config/%s",
 			home, config_filename);
 	} else {
-		fprintf(stderr, "HOME not set\n");
+		kanshi_log(KANSHI_LOG_ERROR, "HOME not set");
 		return NULL;
 	}
 
 	return parse_config(config_path);
 }
 
-static void destroy_config(struct kanshi_config *config) {
-	struct kanshi_profile *profile, *tmp_profile;
-	wl_list_for_each_safe(profile, tmp_profile, &config->profiles, link) {
-		struct kanshi_profile_output *output, *tmp_output;
-		wl_list_for_each_safe(output, tmp_output, &profile->outputs, link) {
-			free(output->name);
-			wl_list_remove(&output->link);
-			free(output);
+static enum kanshi_apply_result switch_profile(struct kanshi_state *state,
+		struct kanshi_profile *profile) {
+	assert(wl_list_length(&state->heads) <= HEADS_MAX);
+	struct kanshi_profile_output *matches[HEADS_MAX];
+	if (!kanshi_match_profile(state, profile, matches)) {
+		kanshi_log(KANSHI_LOG_ERROR, "profile '%s' doesn't match the connected outputs",
+			profile->name);
+		return KANSHI_APPLY_NO_MATCH;
+	}
+	// A profile applied on request doesn't fall back to another one
+	clear_candidates(state);
+	if (profile != state->current_profile &&
+			profile != state->pending_profile) {
+		send_event(state, KANSHI_EVENT_PROFILE_MATCHED, profile, NULL);
+	}
+	return apply_profile(state, profile, matches);
+}
+
+static enum kanshi_apply_result reapply(struct kanshi_state *state) {
+	enum kanshi_apply_result result;
+	if (state->requested_profile != NULL) {
+		result = switch_profile(state, state->requested_profile);
+	} else {
+		result = try_apply_profiles(state);
+	}
+	kanshi_ipc_apply_done(state, result);
+	return result;
+}
+
+uint32_t kanshi_awaited_transaction(struct kanshi_state *state) {
+	if (state->transaction != NULL && !state->superseded) {
+		return state->transaction->id;
+	}
+	// The one in flight gets superseded by the next one
+	return state->transactions + 1;
+}
+
+enum kanshi_apply_result kanshi_switch_profile(struct kanshi_state *state,
+		struct kanshi_profile *profile) {
+	state->requested_profile = profile;
+	state->retries = 0;
+	return switch_profile(state, profile);
+}
+
+enum kanshi_apply_result kanshi_apply_override(struct kanshi_state *state,
+		struct kanshi_config *config, bool keep) {
+	assert(wl_list_length(&config->profiles) == 1);
+	struct kanshi_profile *profile =
+		wl_container_of(config->profiles.next, profile, link);
+
+	destroy_override(state);
+	state->override_config = config;
+	state->override_keep = keep;
+
+	enum kanshi_apply_result result = kanshi_switch_profile(state, profile);
+	if (result == KANSHI_APPLY_NO_MATCH || result == KANSHI_APPLY_FAILED) {
+		destroy_override(state);
+	}
+	return result;
+}
+
+// The config is parsed on a separate thread, so that hotplugs are still
+// handled meanwhile, and swapped in by the event loop once it's ready
+struct kanshi_reload {
+	pthread_t thread;
+	const char *config_arg;
+	int notify_fd;
+	struct kanshi_config *config; // NULL if invalid
+};
+
+static void *reload_thread(void *data) {
+	struct kanshi_reload *reload = data;
+	reload->config = read_config(reload->config_arg);
+	char c = 0;
+	if (write(reload->notify_fd, &c, sizeof(c)) != sizeof(c)) {
+		kanshi_log(KANSHI_LOG_ERROR, "write to reload pipe failed: %s",
+			strerror(errno));
+	}
+	return NULL;
+}
+
+bool kanshi_reload_config(struct kanshi_daemon *daemon) {
+	if (daemon->reload != NULL) {
+		// The file may have changed after it was read
+		daemon->reload_again = true;
+		return true;
+	}
+
+	kanshi_log(KANSHI_LOG_INFO, "reloading config");
+	struct kanshi_reload *reload = calloc(1, sizeof(*reload));
+	if (reload == NULL) {
+		kanshi_log(KANSHI_LOG_ERROR, "failed to allocate reload");
+		return false;
+	}
+	reload->config_arg = daemon->config_arg;
+	reload->notify_fd = daemon->reload_fds[1];
+	int ret = pthread_create(&reload->thread, NULL, reload_thread, reload);
+	if (ret != 0) {
+		kanshi_log(KANSHI_LOG_ERROR, "pthread_create failed: %s",
+			strerror(ret));
+		free(reload);
+		return false;
+	}
+	daemon->reload = reload;
+	return true;
+}
+
+static void finish_reload(struct kanshi_daemon *daemon) {
+	pthread_join(daemon->reload->thread, NULL);
+	if (daemon->reload->config != NULL) {
+		destroy_config(daemon->reload->config);
+	}
+	free(daemon->reload);
+	daemon->reload = NULL;
+}
+
+static void apply_reloaded_config(struct kanshi_state *state) {
+	kanshi_trace_reload(state);
+	send_event(state, KANSHI_EVENT_RELOAD_DONE, NULL, NULL);
+
+	enum kanshi_apply_result result;
+	if (state->override_config != NULL && state->override_keep) {
+		// The override is kept until the next hotplug
+		result = KANSHI_APPLY_UNCHANGED;
+	} else {
+		destroy_override(state);
+		state->retries = 0;
+		result = reapply(state);
+	}
+	kanshi_ipc_reload_done(state, true, result);
+}
+
+bool kanshi_handle_reload(struct kanshi_daemon *daemon) {
+	if (daemon->reload == NULL) {
+		return true;
+	}
+	struct kanshi_config *config = daemon->reload->config;
+	daemon->reload->config = NULL;
+	finish_reload(daemon);
+
+	if (daemon->reload_again) {
+		daemon->reload_again = false;
+		if (config != NULL) {
+			destroy_config(config);
+		}
+		if (kanshi_reload_config(daemon)) {
+			return true;
+		}
+		config = NULL;
+	}
+
+	struct kanshi_state *state;
+	if (config == NULL) {
+		wl_list_for_each(state, &daemon->states, link) {
+			kanshi_ipc_reload_done(state, false, KANSHI_APPLY_FAILED);
 		}
-		struct kanshi_profile_command *command, *tmp_command;
-		wl_list_for_each_safe(command, tmp_command, &profile->commands, link) {
-			free(command->command);
-			wl_list_remove(&command->link);
-			free(command);
+		// With --restore, there is no previous config to keep using
+		return daemon->config != NULL;
+	}
+
+	if (daemon->config != NULL) {
+		wl_list_for_each(state, &daemon->states, link) {
+			forget_profiles(state, daemon->config);
 		}
-		wl_list_remove(&profile->link);
-		free(profile);
+		destroy_config(daemon->config);
+	}
+	daemon->config = config;
+	wl_list_for_each(state, &daemon->states, link) {
+		apply_reloaded_config(state);
 	}
-	free(config);
+	return true;
 }
 
-bool kanshi_reload_config(struct kanshi_state *state) {
-	fprintf(stderr, "reloading config\n");
-	struct kanshi_config *config = read_config(state->config_arg);
-	if (config != NULL) {
-		destroy_config(state->config);
-		state->config = config;
-		state->pending_profile = NULL;
-		state->current_profile = NULL;
-		return try_apply_profiles(state);
+static int run_dry(struct kanshi_state *state) {
+	if (!find_candidates(state)) {
+		kanshi_log(KANSHI_LOG_INFO, "no profile matched");
+		return EXIT_FAILURE;
+	}
+	struct kanshi_profile *profile = state->candidates[0].profile;
+
+	printf("Profile '%s' would be applied:\n", profile->name);
+	describe_configuration(state, state->candidates[0].matches, stdout);
+	fflush(stdout);
+	if (kanshi_test_profile(state, profile) != KANSHI_APPLY_PENDING) {
+		return EXIT_FAILURE;
+	}
+	while (!wl_list_empty(&state->pending_profiles)) {
+		if (wl_display_dispatch(state->display) == -1) {
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (!state->dry_run_accepted) {
+		printf("The compositor didn't accept the configuration\n");
+		return EXIT_FAILURE;
 	}
-	return false;
+	printf("The compositor accepted the configuration\n");
+	return EXIT_SUCCESS;
 }
 
 static const char usage[] = "Usage: %s [options...]\n"
 "  -h, --help           Show help message and quit\n"
-"  -c, --config <path>  Path to config file.\n";
+"  -c, --config <path>  Path to config file.\n"
+"  --display <name>     Manage the outputs of this Wayland display instead of\n"
+"                       $WAYLAND_DISPLAY, can be given several times.\n"
+"  --test-first         Test configurations before applying them.\n"
+"  --best-match         Prefer the most specific matching profile.\n"
+"  --restore            Save applied layouts and restore the last one on\n"
+"                       startup, before loading the config.\n"
+"  --reconnect          Connect again when the compositor restarts, instead\n"
+"                       of exiting.\n"
+"  --dry-run            Print the configuration of the matching profile and\n"
+"                       whether the compositor accepts it, then exit.\n"
+"  --record <path>      Record output management events to a trace file.\n"
+"  --replay <path>      Replay a trace file instead of connecting to the\n"
+"                       compositor, then exit.\n"
+"  --replay-loops <n>   Replay the trace n times and fail if memory use grows\n"
+"                       after the first tenth. Defaults to 1.\n"
+"  --log-level <level>  Print messages up to this level: silent, error, info\n"
+"                       or debug. Defaults to info.\n"
+"  --log-history <n>    Keep the last n messages in memory, to be dumped on\n"
+"                       SIGUSR1. Defaults to 256, 0 disables it.\n"
+"  --log-history-level <level>\n"
+"                       Keep messages up to this level in memory. Defaults to\n"
+"                       debug.\n"
+"  --metrics <path>     Write metrics for the node exporter textfile collector\n"
+"                       to this file.\n"
+"  --metrics-interval <seconds>\n"
+"                       How often to write metrics. Defaults to 15.\n";
+
+enum {
+	OPT_RECORD = 256,
+	OPT_REPLAY,
+	OPT_REPLAY_LOOPS,
+	OPT_TEST_FIRST,
+	OPT_DRY_RUN,
+	OPT_BEST_MATCH,
+	OPT_RESTORE,
+	OPT_RECONNECT,
+	OPT_DISPLAY,
+	OPT_LOG_LEVEL,
+	OPT_LOG_HISTORY,
+	OPT_LOG_HISTORY_LEVEL,
+	OPT_METRICS,
+	OPT_METRICS_INTERVAL,
+};
+
+#define LOG_HISTORY_DEFAULT 256
+#define METRICS_INTERVAL_DEFAULT 15
 
 static const struct option long_options[] = {
 	{"help", no_argument, 0, 'h'},
 	{"config", required_argument, 0, 'c'},
+	{"record", required_argument, 0, OPT_RECORD},
+	{"replay", required_argument, 0, OPT_REPLAY},
+	{"replay-loops", required_argument, 0, OPT_REPLAY_LOOPS},
+	{"test-first", no_argument, 0, OPT_TEST_FIRST},
+	{"dry-run", no_argument, 0, OPT_DRY_RUN},
+	{"best-match", no_argument, 0, OPT_BEST_MATCH},
+	{"restore", no_argument, 0, OPT_RESTORE},
+	{"reconnect", no_argument, 0, OPT_RECONNECT},
+	{"display", required_argument, 0, OPT_DISPLAY},
+	{"log-level", required_argument, 0, OPT_LOG_LEVEL},
+	{"log-history", required_argument, 0, OPT_LOG_HISTORY},
+	{"log-history-level", required_argument, 0, OPT_LOG_HISTORY_LEVEL},
+	{"metrics", required_argument, 0, OPT_METRICS},
+	{"metrics-interval", required_argument, 0, OPT_METRICS_INTERVAL},
 	{0},
 };
 
+static bool parse_int(const char *str, int min, int *out) {
+	char *end;
+	errno = 0;
+	long n = strtol(str, &end, 10);
+	if (errno != 0 || *str == '\0' || *end != '\0' || n < min ||
+			n > INT_MAX) {
+		return false;
+	}
+	*out = n;
+	return true;
+}
+
+static struct kanshi_state *create_state(struct kanshi_daemon *daemon,
+		const struct kanshi_state *options, const char *display_name) {
+	struct kanshi_state *state = calloc(1, sizeof(*state));
+	if (state == NULL) {
+		kanshi_log(KANSHI_LOG_ERROR, "failed to allocate state");
+		return NULL;
+	}
+	*state = *options;
+	state->daemon = daemon;
+	state->display_name = display_name;
+	state->timer_fd = -1;
+	wl_list_init(&state->heads);
+	wl_list_init(&state->pending_profiles);
+	wl_list_insert(daemon->states.prev, &state->link);
+	return state;
+}
+
+static void destroy_state(struct kanshi_state *state) {
+	kanshi_free_ipc(state);
+	if (state->display != NULL) {
+		disconnect_display(state);
+	}
+	kanshi_trace_close(state);
+	if (state->restored_config != NULL) {
+		destroy_config(state->restored_config);
+	}
+	free(state->candidates);
+	if (state->timer_fd >= 0) {
+		close(state->timer_fd);
+	}
+	wl_list_remove(&state->link);
+	free(state);
+}
+
+static bool init_state(struct kanshi_state *state, const char *record_arg,
+		const char *replay_arg) {
+	if (replay_arg != NULL) {
+		state->display = kanshi_replay_connect(state);
+	} else {
+		state->display = wl_display_connect(state->display_name);
+	}
+	if (state->display == NULL) {
+		kanshi_log(KANSHI_LOG_ERROR, "failed to connect to display%s%s",
+			state->display_name != NULL ? " " : "",
+			state->display_name != NULL ? state->display_name : "");
+		return false;
+	}
+
+	if (record_arg != NULL && !kanshi_trace_open(state, record_arg)) {
+		return false;
+	}
+	if (replay_arg == NULL && !state->dry_run && kanshi_init_ipc(state) != 0) {
+		return false;
+	}
+	if (replay_arg == NULL) {
+		state->timer_fd = timerfd_create(CLOCK_MONOTONIC,
+			TFD_NONBLOCK | TFD_CLOEXEC);
+		if (state->timer_fd < 0) {
+			kanshi_log(KANSHI_LOG_ERROR, "timerfd_create failed: %s",
+				strerror(errno));
+			return false;
+		}
+	}
+
+	state->registry = wl_display_get_registry(state->display);
+	wl_registry_add_listener(state->registry, &registry_listener, state);
+	if (replay_arg != NULL) {
+		return true;
+	}
+
+	wl_display_dispatch(state->display);
+	wl_display_roundtrip(state->display);
+
+	if (state->output_manager == NULL) {
+		kanshi_log(KANSHI_LOG_ERROR, "compositor doesn't support "
+			"wlr-output-management-unstable-v1");
+		return false;
+	}
+	return true;
+}
+
 int main(int argc, char *argv[]) {
 	const char *config_arg = NULL;
+	const char *record_arg = NULL;
+	const char *replay_arg = NULL;
+	int replay_loops = 1;
+	bool test_first = false, dry_run = false, best_match = false;
+	bool restore = false, reconnect = false;
+	enum kanshi_log_level log_level = KANSHI_LOG_INFO;
+	int log_history = LOG_HISTORY_DEFAULT;
+	enum kanshi_log_level log_history_level = KANSHI_LOG_DEBUG;
+	const char *metrics_arg = NULL;
+	int metrics_interval = METRICS_INTERVAL_DEFAULT;
+	const char **display_args = calloc(argc, sizeof(*display_args));
+	size_t display_args_len = 0;
+	if (display_args == NULL) {
+		kanshi_log(KANSHI_LOG_ERROR, "failed to allocate display names");
+		return EXIT_FAILURE;
+	}
 
 	int opt;
 	while ((opt = getopt_long(argc, argv, "hc:", long_options, NULL)) != -1) {
@@ -551,60 +1959,201 @@ int main(int argc, char *argv[]) {
 		case 'c':
 			config_arg = optarg;
 			break;
+		case OPT_RECORD:
+			record_arg = optarg;
+			break;
+		case OPT_REPLAY:
+			replay_arg = optarg;
+			break;
+		case OPT_REPLAY_LOOPS:
+			if (!parse_int(optarg, 1, &replay_loops)) {
+				kanshi_log(KANSHI_LOG_ERROR, "invalid replay loop count: %s",
+					optarg);
+				free(display_args);
+				return EXIT_FAILURE;
+			}
+			break;
+		case OPT_TEST_FIRST:
+			test_first = true;
+			break;
+		case OPT_DRY_RUN:
+			dry_run = true;
+			break;
+		case OPT_BEST_MATCH:
+			best_match = true;
+			break;
+		case OPT_RESTORE:
+			restore = true;
+			break;
+		case OPT_RECONNECT:
+			reconnect = true;
+			break;
+		case OPT_DISPLAY:
+			display_args[display_args_len] = optarg;
+			display_args_len++;
+			break;
+		case OPT_LOG_LEVEL:
+			if (!kanshi_log_parse_level(optarg, &log_level)) {
+				kanshi_log(KANSHI_LOG_ERROR, "invalid log level: %s", optarg);
+				free(display_args);
+				return EXIT_FAILURE;
+			}
+			break;
+		case OPT_LOG_HISTORY:
+			if (!parse_int(optarg, 0, &log_history)) {
+				kanshi_log(KANSHI_LOG_ERROR, "invalid log history length: %s",
+					optarg);
+				free(display_args);
+				return EXIT_FAILURE;
+			}
+			break;
+		case OPT_LOG_HISTORY_LEVEL:
+			if (!kanshi_log_parse_level(optarg, &log_history_level)) {
+				kanshi_log(KANSHI_LOG_ERROR, "invalid log level: %s", optarg);
+				free(display_args);
+				return EXIT_FAILURE;
+			}
+			break;
+		case OPT_METRICS:
+			metrics_arg = optarg;
+			break;
+		case OPT_METRICS_INTERVAL:
+			if (!parse_int(optarg, 1, &metrics_interval)) {
+				kanshi_log(KANSHI_LOG_ERROR, "invalid metrics interval: %s",
+					optarg);
+				free(display_args);
+				return EXIT_FAILURE;
+			}
+			break;
 		case 'h':
 			fprintf(stderr, usage, argv[0]);
+			free(display_args);
 			return EXIT_SUCCESS;
 		default:
 			fprintf(stderr, usage, argv[0]);
+			free(display_args);
 			return EXIT_FAILURE;
 		}
 	}
-
-	struct kanshi_config *config = read_config(config_arg);
-	if (config == NULL) {
+	if (record_arg != NULL && replay_arg != NULL) {
+		kanshi_log(KANSHI_LOG_ERROR, "--record and --replay are mutually exclusive");
+		free(display_args);
 		return EXIT_FAILURE;
 	}
-
-	struct wl_display *display = wl_display_connect(NULL);
-	if (display == NULL) {
-		fprintf(stderr, "failed to connect to display\n");
+	if (display_args_len > 1 &&
+			(record_arg != NULL || replay_arg != NULL || dry_run)) {
+		kanshi_log(KANSHI_LOG_ERROR, "--record, --replay and --dry-run only support "
+			"a single display");
+		free(display_args);
+		return EXIT_FAILURE;
+	}
+	if (display_args_len == 0) {
+		display_args_len = 1; // $WAYLAND_DISPLAY
+	}
+	if (!kanshi_log_init(log_level, log_history_level, log_history)) {
+		free(display_args);
 		return EXIT_FAILURE;
 	}
 
-	struct kanshi_state state = {
+	// When restoring, the config is loaded once the saved layout is applied
+	restore = restore && replay_arg == NULL && !dry_run;
+	struct kanshi_config *config = NULL;
+	if (!restore) {
+		config = read_config(config_arg);
+		if (config == NULL) {
+			kanshi_log_finish();
+			free(display_args);
+			return EXIT_FAILURE;
+		}
+	}
+
+	struct kanshi_daemon daemon = {
 		.running = true,
-		.display = display,
 		.config = config,
 		.config_arg = config_arg,
+		.reload_fds = { -1, -1 },
+		.metrics_path = metrics_arg,
+		.metrics_interval = metrics_interval,
+		.metrics_fd = -1,
+	};
+	wl_list_init(&daemon.states);
+
+	// Settings shared by the states of all displays
+	const struct kanshi_state options = {
+		.test_first = test_first,
+		.best_match = best_match,
+		.restore = restore,
+		.reconnect = reconnect && replay_arg == NULL,
+		.dry_run = dry_run,
 	};
+
+	// Also used when replaying, traces can contain reloads
 	int ret = EXIT_SUCCESS;
-#if KANSHI_HAS_VARLINK
-	if (kanshi_init_ipc(&state) != 0) {
+	if (pipe(daemon.reload_fds) != 0) {
+		kanshi_log(KANSHI_LOG_ERROR, "pipe failed: %s", strerror(errno));
 		ret = EXIT_FAILURE;
 		goto done;
 	}
-#endif
-	wl_list_init(&state.heads);
+	for (size_t i = 0; i < 2; i++) {
+		fcntl(daemon.reload_fds[i], F_SETFD, FD_CLOEXEC);
+	}
+	fcntl(daemon.reload_fds[0], F_SETFL, O_NONBLOCK);
+
+	for (size_t i = 0; i < display_args_len; i++) {
+		struct kanshi_state *state =
+			create_state(&daemon, &options, display_args[i]);
+		if (state == NULL || !init_state(state, record_arg, replay_arg)) {
+			ret = EXIT_FAILURE;
+			goto done;
+		}
+	}
+
+	struct kanshi_state *first =
+		wl_container_of(daemon.states.next, first, link);
+	if (replay_arg != NULL) {
+		ret = kanshi_replay(first, first->registry, replay_arg, replay_loops);
+		goto done;
+	}
+	if (dry_run) {
+		ret = run_dry(first);
+		goto done;
+	}
 
-	struct wl_registry *registry = wl_display_get_registry(display);
-	wl_registry_add_listener(registry, &registry_listener, &state);
-	wl_display_dispatch(display);
-	wl_display_roundtrip(display);
+	// With --restore, the config is parsed while the saved layout is applied
+	if (daemon.config == NULL && !kanshi_reload_config(&daemon)) {
+		ret = EXIT_FAILURE;
+		goto done;
+	}
 
-	if (state.output_manager == NULL) {
-		fprintf(stderr, "compositor doesn't support "
-			"wlr-output-management-unstable-v1\n");
+	if (daemon.metrics_path != NULL && !kanshi_metrics_start(&daemon)) {
 		ret = EXIT_FAILURE;
 		goto done;
 	}
 
-	ret = kanshi_main_loop(&state);
+	ret = kanshi_main_loop(&daemon);
 
 done:
-#if KANSHI_HAS_VARLINK
-	kanshi_free_ipc(&state);
-#endif
-	wl_display_disconnect(display);
+	while (!wl_list_empty(&daemon.states)) {
+		struct kanshi_state *state =
+			wl_container_of(daemon.states.next, state, link);
+		destroy_state(state);
+	}
+	if (daemon.reload != NULL) {
+		finish_reload(&daemon);
+	}
+	if (daemon.config != NULL) {
+		destroy_config(daemon.config);
+	}
+	for (size_t i = 0; i < 2; i++) {
+		if (daemon.reload_fds[i] >= 0) {
+			close(daemon.reload_fds[i]);
+		}
+	}
+	if (daemon.metrics_fd >= 0) {
+		close(daemon.metrics_fd);
+	}
+	free(display_args);
+	kanshi_log_finish();
 
 	return ret;
 }
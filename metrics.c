@@ -0,0 +1,182 @@
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#include "ipc.h"
+#include "kanshi.h"
+#include "log.h"
+#include "metrics.h"
+
+// Metrics are exported in the Prometheus text format, to a file read by the
+// node exporter's textfile collector
+
+static const double bucket_bounds[KANSHI_HISTOGRAM_BUCKETS] = {
+	0.00001, 0.0001, 0.001, 0.01, 0.1, 1, 10,
+};
+
+void kanshi_metrics_observe(struct kanshi_state *state,
+		enum kanshi_duration_type type, const struct timespec *start) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	double duration = (double)(now.tv_sec - start->tv_sec) +
+		(double)(now.tv_nsec - start->tv_nsec) / 1000000000;
+
+	struct kanshi_histogram *histogram = &state->metrics.durations[type];
+	for (size_t i = 0; i < KANSHI_HISTOGRAM_BUCKETS; i++) {
+		if (duration <= bucket_bounds[i]) {
+			histogram->buckets[i]++;
+			break;
+		}
+	}
+	histogram->count++;
+	histogram->sum += duration;
+}
+
+bool kanshi_metrics_start(struct kanshi_daemon *daemon) {
+	daemon->metrics_fd = timerfd_create(CLOCK_MONOTONIC,
+		TFD_NONBLOCK | TFD_CLOEXEC);
+	if (daemon->metrics_fd < 0) {
+		kanshi_log(KANSHI_LOG_ERROR, "timerfd_create failed: %s",
+			strerror(errno));
+		return false;
+	}
+	struct itimerspec spec = {
+		.it_interval = { .tv_sec = daemon->metrics_interval },
+		.it_value = { .tv_sec = daemon->metrics_interval },
+	};
+	if (timerfd_settime(daemon->metrics_fd, 0, &spec, NULL) != 0) {
+		kanshi_log(KANSHI_LOG_ERROR, "timerfd_settime failed: %s",
+			strerror(errno));
+		return false;
+	}
+	return true;
+}
+
+static const char *display_label(struct kanshi_state *state) {
+	const char *name = state->display_name;
+	if (name == NULL) {
+		name = getenv("WAYLAND_DISPLAY");
+	}
+	return name != NULL ? name : "";
+}
+
+static void write_labels(FILE *f, struct kanshi_state *state) {
+	fprintf(f, "display=\"");
+	for (const char *c = display_label(state); *c != '\0'; c++) {
+		if (*c == '\n') {
+			fprintf(f, "\\n");
+			continue;
+		}
+		if (*c == '"' || *c == '\\') {
+			fputc('\\', f);
+		}
+		fputc(*c, f);
+	}
+	fputc('"', f);
+}
+
+static void write_header(FILE *f, const char *name, const char *type,
+		const char *help) {
+	fprintf(f, "# HELP %s %s\n", name, help);
+	fprintf(f, "# TYPE %s %s\n", name, type);
+}
+
+static void write_histogram(FILE *f, struct kanshi_daemon *daemon,
+		enum kanshi_duration_type type, const char *name, const char *help) {
+	write_header(f, name, "histogram", help);
+	struct kanshi_state *state;
+	wl_list_for_each(state, &daemon->states, link) {
+		const struct kanshi_histogram *histogram =
+			&state->metrics.durations[type];
+		uint64_t cumulative = 0;
+		for (size_t i = 0; i < KANSHI_HISTOGRAM_BUCKETS; i++) {
+			cumulative += histogram->buckets[i];
+			fprintf(f, "%s_bucket{", name);
+			write_labels(f, state);
+			fprintf(f, ",le=\"%g\"} %llu\n", bucket_bounds[i],
+				(unsigned long long)cumulative);
+		}
+		fprintf(f, "%s_bucket{", name);
+		write_labels(f, state);
+		fprintf(f, ",le=\"+Inf\"} %llu\n",
+			(unsigned long long)histogram->count);
+		fprintf(f, "%s_sum{", name);
+		write_labels(f, state);
+		fprintf(f, "} %.9g\n", histogram->sum);
+		fprintf(f, "%s_count{", name);
+		write_labels(f, state);
+		fprintf(f, "} %llu\n", (unsigned long long)histogram->count);
+	}
+}
+
+static void write_metrics(FILE *f, struct kanshi_daemon *daemon) {
+	struct kanshi_state *state;
+
+	write_header(f, "kanshi_events_total", "counter",
+		"Events sent to kanshictl monitor, e.g. hotplugs and apply outcomes.");
+	wl_list_for_each(state, &daemon->states, link) {
+		for (size_t i = 0; i < KANSHI_EVENT_COUNT; i++) {
+			fprintf(f, "kanshi_events_total{");
+			write_labels(f, state);
+			fprintf(f, ",event=\"%s\"} %llu\n", kanshi_event_type_str(i),
+				(unsigned long long)state->metrics.events[i]);
+		}
+	}
+
+	write_header(f, "kanshi_exec_failures_total", "counter",
+		"Profile commands which couldn't be executed.");
+	wl_list_for_each(state, &daemon->states, link) {
+		fprintf(f, "kanshi_exec_failures_total{");
+		write_labels(f, state);
+		fprintf(f, "} %llu\n",
+			(unsigned long long)state->metrics.exec_failures);
+	}
+
+	write_histogram(f, daemon, KANSHI_DURATION_MATCH,
+		"kanshi_match_duration_seconds",
+		"Time spent matching the profiles against the connected outputs.");
+	write_histogram(f, daemon, KANSHI_DURATION_TRANSACTION,
+		"kanshi_transaction_duration_seconds",
+		"Time between sending a configuration and the compositor's answer.");
+	write_histogram(f, daemon, KANSHI_DURATION_EXEC,
+		"kanshi_exec_duration_seconds",
+		"Time spent spawning a profile command.");
+}
+
+// The file is replaced at once, so that the collector never reads it
+// half-written
+bool kanshi_metrics_write(struct kanshi_daemon *daemon) {
+	char tmp_path[PATH_MAX];
+	if (snprintf(tmp_path, sizeof(tmp_path), "%s.tmp",
+			daemon->metrics_path) >= (int)sizeof(tmp_path)) {
+		kanshi_log(KANSHI_LOG_ERROR, "metrics path too long: %s",
+			daemon->metrics_path);
+		return false;
+	}
+
+	FILE *f = fopen(tmp_path, "w");
+	if (f == NULL) {
+		kanshi_log(KANSHI_LOG_ERROR, "failed to open %s: %s", tmp_path,
+			strerror(errno));
+		return false;
+	}
+	write_metrics(f, daemon);
+	if (fclose(f) != 0) {
+		kanshi_log(KANSHI_LOG_ERROR, "failed to write %s: %s", tmp_path,
+			strerror(errno));
+		unlink(tmp_path);
+		return false;
+	}
+	if (rename(tmp_path, daemon->metrics_path) != 0) {
+		kanshi_log(KANSHI_LOG_ERROR, "failed to rename %s: %s", tmp_path,
+			strerror(errno));
+		unlink(tmp_path);
+		return false;
+	}
+	return true;
+}
@@ -10,7 +10,9 @@
 #include <wayland-client.h>
 
 #include "config.h"
+#include "log.h"
 #include "parser.h"
+#include "probes.h"
 
 static const char *token_type_str(enum kanshi_token_type t) {
 	switch (t) {
@@ -36,7 +38,7 @@ static int parser_read_char(struct kanshi_parser *parser) {
 	int ch = fgetc(parser->f);
 	if (ch == EOF) {
 		if (errno != 0) {
-			fprintf(stderr, "fgetc failed: %s\n", strerror(errno));
+			kanshi_log(KANSHI_LOG_ERROR, "fgetc failed: %s", strerror(errno));
 		} else {
 			return '\0';
 		}
@@ -62,7 +64,7 @@ static int parser_peek_char(struct kanshi_parser *parser) {
 static bool parser_append_tok_ch(struct kanshi_parser *parser, char ch) {
 	// Always keep enough room for a terminating NULL char
 	if (parser->tok_str_len + 1 >= sizeof(parser->tok_str)) {
-		fprintf(stderr, "string too long\n");
+		kanshi_log(KANSHI_LOG_ERROR, "string too long");
 		return false;
 	}
 	parser->tok_str[parser->tok_str_len] = ch;
@@ -76,7 +78,7 @@ static bool parser_read_quoted(struct kanshi_parser *parser, char quote_char) {
 		if (ch < 0) {
 			return false;
 		} else if (ch == '\0') {
-			fprintf(stderr, "unterminated quoted string\n");
+			kanshi_log(KANSHI_LOG_ERROR, "unterminated quoted string");
 			return false;
 		}
 
@@ -181,7 +183,7 @@ static bool parser_expect_token(struct kanshi_parser *parser,
 		return false;
 	}
 	if (parser->tok_type != want) {
-		fprintf(stderr, "expected %s, got %s\n",
+		kanshi_log(KANSHI_LOG_ERROR, "expected %s, got %s",
 			token_type_str(want), token_type_str(parser->tok_type));
 		return false;
 	}
@@ -199,22 +201,36 @@ static bool parse_int(int *dst, const char *str) {
 	return true;
 }
 
-static bool parse_mode(struct kanshi_profile_output *output, char *str) {
-	const char *width = strtok(str, "x");
-	const char *height = strtok(NULL, "@");
-	const char *refresh = strtok(NULL, "");
+static bool parse_mode(struct kanshi_output_settings *output, char *str) {
+	output->mode.policy = KANSHI_MODE_EXACT;
+	if (strcmp(str, "preferred") == 0) {
+		output->mode.policy = KANSHI_MODE_PREFERRED;
+		return true;
+	} else if (strcmp(str, "highest-refresh") == 0) {
+		output->mode.policy = KANSHI_MODE_HIGHEST_REFRESH;
+		return true;
+	} else if (strcmp(str, "highest-resolution") == 0) {
+		output->mode.policy = KANSHI_MODE_HIGHEST_RESOLUTION;
+		return true;
+	}
+
+	// Configs may be parsed on another thread than the event loop's
+	char *saveptr;
+	const char *width = strtok_r(str, "x", &saveptr);
+	const char *height = strtok_r(NULL, "@", &saveptr);
+	const char *refresh = strtok_r(NULL, "", &saveptr);
 
 	if (width == NULL || height == NULL) {
-		fprintf(stderr, "invalid output mode: missing width/height\n");
+		kanshi_log(KANSHI_LOG_ERROR, "invalid output mode: missing width/height");
 		return false;
 	}
 
 	if (!parse_int(&output->mode.width, width)) {
-		fprintf(stderr, "invalid output mode: invalid width\n");
+		kanshi_log(KANSHI_LOG_ERROR, "invalid output mode: invalid width");
 		return false;
 	}
 	if (!parse_int(&output->mode.height, height)) {
-		fprintf(stderr, "invalid output mode: invalid height\n");
+		kanshi_log(KANSHI_LOG_ERROR, "invalid output mode: invalid height");
 		return false;
 	}
 
@@ -224,7 +240,7 @@ static bool parse_mode(struct kanshi_profile_output *output, char *str) {
 		float v = strtof(refresh, &end);
 		if (errno != 0 || (end[0] != '\0' && strcmp(end, "Hz") != 0) ||
 				str[0] == '\0') {
-			fprintf(stderr, "invalid output mode: invalid refresh rate\n");
+			kanshi_log(KANSHI_LOG_ERROR, "invalid output mode: invalid refresh rate");
 			return false;
 		}
 		output->mode.refresh = v * 1000;
@@ -233,21 +249,22 @@ static bool parse_mode(struct kanshi_profile_output *output, char *str) {
 	return true;
 }
 
-static bool parse_position(struct kanshi_profile_output *output, char *str) {
-	const char *x = strtok(str, ",");
-	const char *y = strtok(NULL, "");
+static bool parse_position(struct kanshi_output_settings *output, char *str) {
+	char *saveptr;
+	const char *x = strtok_r(str, ",", &saveptr);
+	const char *y = strtok_r(NULL, "", &saveptr);
 
 	if (x == NULL || y == NULL) {
-		fprintf(stderr, "invalid output position: missing x/y\n");
+		kanshi_log(KANSHI_LOG_ERROR, "invalid output position: missing x/y");
 		return false;
 	}
 
 	if (!parse_int(&output->position.x, x)) {
-		fprintf(stderr, "invalid output position: invalid x\n");
+		kanshi_log(KANSHI_LOG_ERROR, "invalid output position: invalid x");
 		return false;
 	}
 	if (!parse_int(&output->position.y, y)) {
-		fprintf(stderr, "invalid output position: invalid y\n");
+		kanshi_log(KANSHI_LOG_ERROR, "invalid output position: invalid y");
 		return false;
 	}
 
@@ -288,64 +305,191 @@ static bool parse_transform(enum wl_output_transform *dst, const char *str) {
 	return true;
 }
 
-static struct kanshi_profile_output *parse_profile_output(
-		struct kanshi_parser *parser) {
-	struct kanshi_profile_output *output = calloc(1, sizeof(*output));
+static bool parse_toggle(bool *dst, const char *str) {
+	if (strcmp(str, "on") == 0) {
+		*dst = true;
+	} else if (strcmp(str, "off") == 0) {
+		*dst = false;
+	} else {
+		return false;
+	}
+	return true;
+}
 
-	if (!parser_expect_token(parser, KANSHI_TOKEN_STR)) {
-		return NULL;
+// FNV-1a, used to quickly compare criteria with head identifiers
+uint32_t hash_criteria(const char *str) {
+	uint32_t hash = 2166136261u;
+	for (const char *c = str; *c != '\0'; c++) {
+		hash ^= (unsigned char)*c;
+		hash *= 16777619u;
 	}
-	output->name = strdup(parser->tok_str);
+	return hash;
+}
+
+static struct kanshi_output_template *find_output_template(
+		struct kanshi_config *config, const char *name) {
+	struct kanshi_output_template *template;
+	wl_list_for_each(template, &config->output_templates, link) {
+		if (strcmp(template->name, name) == 0) {
+			return template;
+		}
+	}
+	return NULL;
+}
+
+static struct kanshi_profile *find_profile_template(
+		struct kanshi_config *config, const char *name) {
+	struct kanshi_profile *template;
+	wl_list_for_each(template, &config->profile_templates, link) {
+		if (strcmp(template->name, name) == 0) {
+			return template;
+		}
+	}
+	return NULL;
+}
+
+// Makes sure the settings of an output can be modified, copying them if they
+// are shared with a template
+static bool own_output_settings(struct kanshi_profile_output *output) {
+	if (output->owns_settings) {
+		return true;
+	}
+	struct kanshi_output_settings *settings = calloc(1, sizeof(*settings));
+	if (settings == NULL) {
+		kanshi_log(KANSHI_LOG_ERROR, "failed to allocate output settings");
+		return false;
+	}
+	if (output->settings != NULL) {
+		*settings = *output->settings;
+	}
+	output->settings = settings;
+	output->owns_settings = true;
+	return true;
+}
 
+static void merge_output_settings(struct kanshi_output_settings *dst,
+		const struct kanshi_output_settings *src) {
+	if (src->fields & KANSHI_OUTPUT_ENABLED) {
+		dst->enabled = src->enabled;
+	}
+	if (src->fields & KANSHI_OUTPUT_MODE) {
+		dst->mode = src->mode;
+	}
+	if (src->fields & KANSHI_OUTPUT_POSITION) {
+		dst->position = src->position;
+	}
+	if (src->fields & KANSHI_OUTPUT_SCALE) {
+		dst->scale = src->scale;
+	}
+	if (src->fields & KANSHI_OUTPUT_TRANSFORM) {
+		dst->transform = src->transform;
+	}
+	if (src->fields & KANSHI_OUTPUT_ADAPTIVE_SYNC) {
+		dst->adaptive_sync = src->adaptive_sync;
+	}
+	dst->fields |= src->fields;
+}
+
+static bool use_output_template(struct kanshi_config *config,
+		struct kanshi_profile_output *output, const char *name) {
+	struct kanshi_output_template *template =
+		find_output_template(config, name);
+	if (template == NULL) {
+		kanshi_log(KANSHI_LOG_ERROR, "unknown output template '%s'", name);
+		return false;
+	}
+	if (output->settings == NULL) {
+		// Nothing to merge with, share the template's settings
+		output->settings = &template->settings;
+		return true;
+	}
+	if (!own_output_settings(output)) {
+		return false;
+	}
+	merge_output_settings(output->settings, &template->settings);
+	return true;
+}
+
+// Parses output commands until the end of the line, starting with the
+// current token
+static bool parse_output_settings(struct kanshi_parser *parser,
+		struct kanshi_config *config, struct kanshi_profile_output *output) {
 	bool has_key = false;
 	enum kanshi_output_field key = 0;
+	bool use = false, custom_mode = false;
 	while (1) {
-		if (!parser_next_token(parser)) {
-			return NULL;
-		}
-
 		switch (parser->tok_type) {
 		case KANSHI_TOKEN_STR:
-			if (has_key) {
+			if (use) {
+				if (!use_output_template(config, output, parser->tok_str)) {
+					return false;
+				}
+				use = false;
+			} else if (has_key && key == KANSHI_OUTPUT_MODE &&
+					strcmp(parser->tok_str, "--custom") == 0) {
+				custom_mode = true;
+			} else if (has_key) {
+				if (!own_output_settings(output)) {
+					return false;
+				}
+				struct kanshi_output_settings *settings = output->settings;
 				char *value = parser->tok_str;
 				switch (key) {
 				case KANSHI_OUTPUT_MODE:
-					if (!parse_mode(output, value)) {
-						return NULL;
+					if (!parse_mode(settings, value)) {
+						return false;
 					}
+					if (custom_mode &&
+							settings->mode.policy != KANSHI_MODE_EXACT) {
+						kanshi_log(KANSHI_LOG_ERROR, "invalid output mode: --custom "
+							"requires a width and a height");
+						return false;
+					}
+					settings->mode.custom = custom_mode;
+					custom_mode = false;
 					break;
 				case KANSHI_OUTPUT_POSITION:
-					if (!parse_position(output, value)) {
-						return NULL;
+					if (!parse_position(settings, value)) {
+						return false;
 					}
 					break;
 				case KANSHI_OUTPUT_SCALE:
-					if (!parse_float(&output->scale, value)) {
-						fprintf(stderr, "invalid output scale\n");
-						return NULL;
+					if (!parse_float(&settings->scale, value)) {
+						kanshi_log(KANSHI_LOG_ERROR, "invalid output scale");
+						return false;
 					}
 					break;
 				case KANSHI_OUTPUT_TRANSFORM:
-					if (!parse_transform(&output->transform, value)) {
-						fprintf(stderr, "invalid output transform\n");
-						return NULL;
+					if (!parse_transform(&settings->transform, value)) {
+						kanshi_log(KANSHI_LOG_ERROR, "invalid output transform");
+						return false;
+					}
+					break;
+				case KANSHI_OUTPUT_ADAPTIVE_SYNC:
+					if (!parse_toggle(&settings->adaptive_sync, value)) {
+						kanshi_log(KANSHI_LOG_ERROR, "invalid output adaptive_sync");
+						return false;
 					}
 					break;
 				default:
 					abort();
 				}
 				has_key = false;
-				output->fields |= key;
+				settings->fields |= key;
 			} else {
 				has_key = true;
 				const char *key_str = parser->tok_str;
-				if (strcmp(key_str, "enable") == 0) {
-					output->enabled = true;
-					output->fields |= KANSHI_OUTPUT_ENABLED;
+				if (strcmp(key_str, "enable") == 0 ||
+						strcmp(key_str, "disable") == 0) {
+					if (!own_output_settings(output)) {
+						return false;
+					}
+					output->settings->enabled =
+						strcmp(key_str, "enable") == 0;
+					output->settings->fields |= KANSHI_OUTPUT_ENABLED;
 					has_key = false;
-				} else if (strcmp(key_str, "disable") == 0) {
-					output->enabled = false;
-					output->fields |= KANSHI_OUTPUT_ENABLED;
+				} else if (strcmp(key_str, "use") == 0) {
+					use = true;
 					has_key = false;
 				} else if (strcmp(key_str, "mode") == 0) {
 					key = KANSHI_OUTPUT_MODE;
@@ -355,24 +499,66 @@ static struct kanshi_profile_output *parse_profile_output(
 					key = KANSHI_OUTPUT_SCALE;
 				} else if (strcmp(key_str, "transform") == 0) {
 					key = KANSHI_OUTPUT_TRANSFORM;
+				} else if (strcmp(key_str, "adaptive_sync") == 0) {
+					key = KANSHI_OUTPUT_ADAPTIVE_SYNC;
 				} else {
-					fprintf(stderr,
-						"unknown directive '%s' in profile output '%s'\n",
+					kanshi_log(KANSHI_LOG_ERROR,
+						"unknown directive '%s' in profile output '%s'",
 						key_str, output->name);
-					return NULL;
+					return false;
 				}
 			}
 			break;
 		case KANSHI_TOKEN_NEWLINE:
-			return output;
+			// Outputs without any command still need settings
+			return output->settings != NULL || own_output_settings(output);
 		default:
-			fprintf(stderr, "unexpected %s in output\n",
+			kanshi_log(KANSHI_LOG_ERROR, "unexpected %s in output",
 				token_type_str(parser->tok_type));
-			return NULL;
+			return false;
+		}
+
+		if (!parser_next_token(parser)) {
+			return false;
 		}
 	}
 }
 
+static void destroy_profile_output(struct kanshi_profile_output *output) {
+	free(output->name);
+	if (output->owns_settings) {
+		free(output->settings);
+	}
+	free(output);
+}
+
+static struct kanshi_profile_output *parse_profile_output(
+		struct kanshi_parser *parser, struct kanshi_config *config) {
+	if (!parser_expect_token(parser, KANSHI_TOKEN_STR)) {
+		return NULL;
+	}
+
+	struct kanshi_profile_output *output = calloc(1, sizeof(*output));
+	if (output == NULL) {
+		kanshi_log(KANSHI_LOG_ERROR, "failed to allocate profile output");
+		return NULL;
+	}
+	output->name = strdup(parser->tok_str);
+	if (output->name == NULL) {
+		kanshi_log(KANSHI_LOG_ERROR, "failed to allocate profile output name");
+		free(output);
+		return NULL;
+	}
+	output->name_hash = hash_criteria(output->name);
+
+	if (!parser_next_token(parser) ||
+			!parse_output_settings(parser, config, output)) {
+		destroy_profile_output(output);
+		return NULL;
+	}
+	return output;
+}
+
 static struct kanshi_profile_command *parse_profile_command(
 		struct kanshi_parser *parser) {
 	// Skip the 'exec' directive.
@@ -385,97 +571,295 @@ static struct kanshi_profile_command *parse_profile_command(
 	}
 
 	if (parser->tok_str_len <= 0) {
-		fprintf(stderr, "Ignoring empty command in config file on line %d\n",
+		kanshi_log(KANSHI_LOG_ERROR, "Ignoring empty command in config file on line %d",
 			parser->line);
 		return NULL;
 	}
 
 	struct kanshi_profile_command *command = calloc(1, sizeof(*command));
+	if (command == NULL) {
+		kanshi_log(KANSHI_LOG_ERROR, "failed to allocate profile command");
+		return NULL;
+	}
 	command->command = strdup(parser->tok_str);
+	if (command->command == NULL) {
+		kanshi_log(KANSHI_LOG_ERROR, "failed to allocate profile command");
+		free(command);
+		return NULL;
+	}
 	return command;
 }
 
-static struct kanshi_profile *parse_profile(struct kanshi_parser *parser) {
-	struct kanshi_profile *profile = calloc(1, sizeof(*profile));
-	wl_list_init(&profile->outputs);
-	wl_list_init(&profile->commands);
+static void add_profile_output(struct kanshi_profile *profile,
+		struct kanshi_profile_output *output) {
+	// Store wildcard outputs at the end of the list
+	if (strcmp(output->name, "*") == 0) {
+		wl_list_insert(profile->outputs.prev, &output->link);
+	} else {
+		wl_list_insert(&profile->outputs, &output->link);
+	}
+}
 
-	if (!parser_next_token(parser)) {
-		return NULL;
+static bool copy_template_output(struct kanshi_profile *profile,
+		struct kanshi_profile_output *template_output) {
+	struct kanshi_profile_output *output = calloc(1, sizeof(*output));
+	if (output == NULL) {
+		kanshi_log(KANSHI_LOG_ERROR, "failed to allocate profile output");
+		return false;
+	}
+	output->name = strdup(template_output->name);
+	if (output->name == NULL) {
+		kanshi_log(KANSHI_LOG_ERROR, "failed to allocate profile output name");
+		free(output);
+		return false;
 	}
+	output->name_hash = template_output->name_hash;
+	output->settings = template_output->settings;
+	add_profile_output(profile, output);
+	return true;
+}
 
-	switch (parser->tok_type) {
-	case KANSHI_TOKEN_LBRACKET:
-		break;
-	case KANSHI_TOKEN_STR:
-		// Parse an optional profile name
-		profile->name = strdup(parser->tok_str);
-		if (!parser_expect_token(parser, KANSHI_TOKEN_LBRACKET)) {
-			return NULL;
+// Adds the outputs and commands of a template to a profile. The output
+// settings are shared with the template.
+static bool use_profile_template(struct kanshi_config *config,
+		struct kanshi_profile *profile, const char *name) {
+	struct kanshi_profile *template = find_profile_template(config, name);
+	if (template == NULL) {
+		kanshi_log(KANSHI_LOG_ERROR, "unknown profile template '%s'", name);
+		return false;
+	}
+
+	// Add the outputs in the order they were declared in. Non-wildcard
+	// outputs are stored in reverse order.
+	struct kanshi_profile_output *template_output;
+	wl_list_for_each_reverse(template_output, &template->outputs, link) {
+		if (strcmp(template_output->name, "*") != 0 &&
+				!copy_template_output(profile, template_output)) {
+			return false;
+		}
+	}
+	wl_list_for_each(template_output, &template->outputs, link) {
+		if (strcmp(template_output->name, "*") == 0 &&
+				!copy_template_output(profile, template_output)) {
+			return false;
 		}
-		break;
-	default:
-		fprintf(stderr, "unexpected %s, expected '{' or a profile name\n",
-			token_type_str(parser->tok_type));
 	}
 
-	// Use the bracket position to generate a default profile name
-	if (profile->name == NULL) {
-		char generated_name[100];
-		int ret = snprintf(generated_name, sizeof(generated_name),
-				"<anonymous at line %d, col %d>", parser->line, parser->col);
-		if (ret >= 0) {
-			profile->name = strdup(generated_name);
-		} else {
-			profile->name = strdup("<anonymous>");
+	struct kanshi_profile_command *template_command;
+	wl_list_for_each(template_command, &template->commands, link) {
+		struct kanshi_profile_command *command = calloc(1, sizeof(*command));
+		if (command == NULL) {
+			kanshi_log(KANSHI_LOG_ERROR, "failed to allocate profile command");
+			return false;
 		}
+		command->command = strdup(template_command->command);
+		if (command->command == NULL) {
+			kanshi_log(KANSHI_LOG_ERROR, "failed to allocate profile command");
+			free(command);
+			return false;
+		}
+		wl_list_insert(profile->commands.prev, &command->link);
 	}
 
-	// Parse the profile commands until the closing bracket
+	profile->partial |= template->partial;
+	return true;
+}
+
+// Parses the profile directives until the closing bracket
+static bool parse_profile_directives(struct kanshi_parser *parser,
+		struct kanshi_config *config, struct kanshi_profile *profile) {
 	while (1) {
 		if (!parser_next_token(parser)) {
-			return NULL;
+			return false;
 		}
 
 		switch (parser->tok_type) {
 		case KANSHI_TOKEN_RBRACKET:
-			return profile;
+			return true;
 		case KANSHI_TOKEN_STR:;
 			const char *directive = parser->tok_str;
 			if (strcmp(directive, "output") == 0) {
 				struct kanshi_profile_output *output =
-					parse_profile_output(parser);
+					parse_profile_output(parser, config);
 				if (output == NULL) {
-					return NULL;
+					return false;
 				}
-				// Store wildcard outputs at the end of the list
-				if (strcmp(output->name, "*") == 0) {
-					wl_list_insert(profile->outputs.prev, &output->link);
-				} else {
-					wl_list_insert(&profile->outputs, &output->link);
+				add_profile_output(profile, output);
+			} else if (strcmp(directive, "use") == 0) {
+				if (!parser_expect_token(parser, KANSHI_TOKEN_STR) ||
+						!use_profile_template(config, profile,
+						parser->tok_str) ||
+						!parser_expect_token(parser, KANSHI_TOKEN_NEWLINE)) {
+					return false;
+				}
+			} else if (strcmp(directive, "partial") == 0) {
+				profile->partial = true;
+				if (!parser_expect_token(parser, KANSHI_TOKEN_NEWLINE)) {
+					return false;
 				}
 			} else if (strcmp(directive, "exec") == 0) {
 				struct kanshi_profile_command *command =
 					parse_profile_command(parser);
 				if (command == NULL) {
-					return NULL;
+					return false;
 				}
 				// Insert commands at the end to preserve order
 				wl_list_insert(profile->commands.prev, &command->link);
 			} else {
-				fprintf(stderr, "unknown directive '%s' in profile '%s'\n",
+				kanshi_log(KANSHI_LOG_ERROR, "unknown directive '%s' in profile '%s'",
 					directive, profile->name);
-				return NULL;
+				return false;
 			}
 			break;
 		case KANSHI_TOKEN_NEWLINE:
 			break; // No-op
 		default:
-			fprintf(stderr, "unexpected %s in profile '%s'\n",
+			kanshi_log(KANSHI_LOG_ERROR, "unexpected %s in profile '%s'",
 				token_type_str(parser->tok_type), profile->name);
+			return false;
+		}
+	}
+}
+
+static struct kanshi_profile *create_profile(char *name) {
+	struct kanshi_profile *profile = calloc(1, sizeof(*profile));
+	if (profile == NULL) {
+		kanshi_log(KANSHI_LOG_ERROR, "failed to allocate profile");
+		free(name);
+		return NULL;
+	}
+	profile->name = name;
+	wl_list_init(&profile->link);
+	wl_list_init(&profile->outputs);
+	wl_list_init(&profile->commands);
+	return profile;
+}
+
+static void destroy_profile(struct kanshi_profile *profile) {
+	struct kanshi_profile_output *output, *tmp_output;
+	wl_list_for_each_safe(output, tmp_output, &profile->outputs, link) {
+		wl_list_remove(&output->link);
+		destroy_profile_output(output);
+	}
+	struct kanshi_profile_command *command, *tmp_command;
+	wl_list_for_each_safe(command, tmp_command, &profile->commands, link) {
+		free(command->command);
+		wl_list_remove(&command->link);
+		free(command);
+	}
+	wl_list_remove(&profile->link);
+	free(profile->name);
+	free(profile);
+}
+
+static struct kanshi_profile *parse_profile(struct kanshi_parser *parser,
+		struct kanshi_config *config) {
+	struct kanshi_profile *profile = create_profile(NULL);
+	if (profile == NULL) {
+		return NULL;
+	}
+
+	if (!parser_next_token(parser)) {
+		destroy_profile(profile);
+		return NULL;
+	}
+
+	switch (parser->tok_type) {
+	case KANSHI_TOKEN_LBRACKET:
+		break;
+	case KANSHI_TOKEN_STR:
+		// Parse an optional profile name
+		profile->name = strdup(parser->tok_str);
+		if (!parser_expect_token(parser, KANSHI_TOKEN_LBRACKET)) {
+			destroy_profile(profile);
 			return NULL;
 		}
+		break;
+	default:
+		kanshi_log(KANSHI_LOG_ERROR, "unexpected %s, expected '{' or a profile name",
+			token_type_str(parser->tok_type));
+		destroy_profile(profile);
+		return NULL;
+	}
+
+	// Use the bracket position to generate a default profile name
+	if (profile->name == NULL) {
+		char generated_name[100];
+		int ret = snprintf(generated_name, sizeof(generated_name),
+				"<anonymous at line %d, col %d>", parser->line, parser->col);
+		if (ret >= 0) {
+			profile->name = strdup(generated_name);
+		} else {
+			profile->name = strdup("<anonymous>");
+		}
+	}
+
+	if (profile->name == NULL ||
+			!parse_profile_directives(parser, config, profile)) {
+		destroy_profile(profile);
+		return NULL;
+	}
+	return profile;
+}
+
+// Parses either a profile template, if followed by a bracket, or an output
+// template
+static bool parse_template(struct kanshi_parser *parser,
+		struct kanshi_config *config) {
+	if (!parser_expect_token(parser, KANSHI_TOKEN_STR)) {
+		return false;
+	}
+	if (find_profile_template(config, parser->tok_str) != NULL ||
+			find_output_template(config, parser->tok_str) != NULL) {
+		kanshi_log(KANSHI_LOG_ERROR, "template '%s' is already defined",
+			parser->tok_str);
+		return false;
+	}
+	char *name = strdup(parser->tok_str);
+	if (name == NULL) {
+		kanshi_log(KANSHI_LOG_ERROR, "failed to allocate template name");
+		return false;
+	}
+
+	if (!parser_next_token(parser)) {
+		free(name);
+		return false;
+	}
+
+	if (parser->tok_type == KANSHI_TOKEN_LBRACKET) {
+		struct kanshi_profile *template = create_profile(name);
+		if (template == NULL) {
+			return false;
+		}
+		if (!parse_profile_directives(parser, config, template)) {
+			destroy_profile(template);
+			return false;
+		}
+		wl_list_insert(config->profile_templates.prev, &template->link);
+		return true;
+	}
+
+	struct kanshi_profile_output output = { .name = name };
+	bool ok = parse_output_settings(parser, config, &output);
+	struct kanshi_output_template *template = NULL;
+	if (ok) {
+		template = calloc(1, sizeof(*template));
+		if (template == NULL) {
+			kanshi_log(KANSHI_LOG_ERROR, "failed to allocate output template");
+			ok = false;
+		}
+	}
+	if (ok) {
+		template->name = name;
+		template->settings = *output.settings;
+		wl_list_insert(config->output_templates.prev, &template->link);
+	} else {
+		free(name);
 	}
+	if (output.owns_settings) {
+		free(output.settings);
+	}
+	return ok;
 }
 
 static bool parse_config_file(const char *path, struct kanshi_config *config);
@@ -496,14 +880,16 @@ static bool parse_include_command(struct kanshi_parser *parser, struct kanshi_co
 
 	wordexp_t p;
 	if (wordexp(parser->tok_str, &p, WRDE_SHOWERR | WRDE_UNDEF) != 0) {
-		fprintf(stderr, "Could not expand include path: '%s'\n", parser->tok_str);
+		kanshi_log(KANSHI_LOG_ERROR, "Could not expand include path: '%s'",
+			parser->tok_str);
 		return false;
 	}
 
 	char **w = p.we_wordv;
 	for (size_t idx = 0; idx < p.we_wordc; idx++) {
 		if (!parse_config_file(w[idx], config)) {
-			fprintf(stderr, "Could not parse included config: '%s'\n", w[idx]);
+			kanshi_log(KANSHI_LOG_ERROR, "Could not parse included config: '%s'",
+				w[idx]);
 			wordfree(&p);
 			return false;
 		}
@@ -529,7 +915,7 @@ static bool _parse_config(struct kanshi_parser *parser, struct kanshi_config *co
 
 		if (ch == '{') {
 			// Legacy profile syntax without a profile directive
-			struct kanshi_profile *profile = parse_profile(parser);
+			struct kanshi_profile *profile = parse_profile(parser, config);
 			if (!profile) {
 				return false;
 			}
@@ -541,17 +927,22 @@ static bool _parse_config(struct kanshi_parser *parser, struct kanshi_config *co
 
 			const char *directive = parser->tok_str;
 			if (strcmp(parser->tok_str, "profile") == 0) {
-				struct kanshi_profile *profile = parse_profile(parser);
+				struct kanshi_profile *profile = parse_profile(parser, config);
 				if (!profile) {
 					return false;
 				}
 				wl_list_insert(config->profiles.prev, &profile->link);
+			} else if (strcmp(parser->tok_str, "template") == 0) {
+				if (!parse_template(parser, config)) {
+					return false;
+				}
 			} else if (strcmp(parser->tok_str, "include") == 0) {
 				if (!parse_include_command(parser, config)) {
 					return false;
 				}
 			} else {
-				fprintf(stderr, "unknown directive '%s'\n", directive);
+				kanshi_log(KANSHI_LOG_ERROR, "unknown directive '%s'",
+					directive);
 				return false;
 			}
 		}
@@ -561,7 +952,7 @@ static bool _parse_config(struct kanshi_parser *parser, struct kanshi_config *co
 static bool parse_config_file(const char *path, struct kanshi_config *config) {
 	FILE *f = fopen(path, "r");
 	if (f == NULL) {
-		fprintf(stderr, "failed to open file %s: %s\n",
+		kanshi_log(KANSHI_LOG_ERROR, "failed to open file %s: %s",
 			path,
 			strerror(errno));
 		return false;
@@ -576,25 +967,106 @@ static bool parse_config_file(const char *path, struct kanshi_config *config) {
 	bool res = _parse_config(&parser, config);
 	fclose(f);
 	if (!res) {
-		fprintf(stderr, "failed to parse config file: "
-			"error on line %d, column %d\n", parser.line, parser.col);
+		kanshi_log(KANSHI_LOG_ERROR, "failed to parse config file: "
+			"error on line %d, column %d", parser.line, parser.col);
 		return false;
 	}
 
 	return true;
 }
 
+void destroy_config(struct kanshi_config *config) {
+	struct kanshi_profile *profile, *tmp_profile;
+	wl_list_for_each_safe(profile, tmp_profile, &config->profiles, link) {
+		destroy_profile(profile);
+	}
+	wl_list_for_each_safe(profile, tmp_profile, &config->profile_templates,
+			link) {
+		destroy_profile(profile);
+	}
+	struct kanshi_output_template *template, *tmp_template;
+	wl_list_for_each_safe(template, tmp_template, &config->output_templates,
+			link) {
+		free(template->name);
+		wl_list_remove(&template->link);
+		free(template);
+	}
+	free(config);
+}
+
 struct kanshi_config *parse_config(const char *path) {
 	struct kanshi_config *config = calloc(1, sizeof(*config));
 	if (config == NULL) {
 		return NULL;
 	}
 	wl_list_init(&config->profiles);
+	wl_list_init(&config->profile_templates);
+	wl_list_init(&config->output_templates);
+
+	KANSHI_PROBE1(config_parse_start, path);
+	bool ok = parse_config_file(path, config);
+	KANSHI_PROBE2(config_parse_end, path, ok);
+	if (!ok) {
+		destroy_config(config);
+		return NULL;
+	}
+
+	return config;
+}
 
-	if (!parse_config_file(path, config)) {
-		free(config);
+struct kanshi_config *parse_config_str(const char *str) {
+	FILE *f = fmemopen((void *)str, strlen(str), "r");
+	if (f == NULL) {
+		kanshi_log(KANSHI_LOG_ERROR, "fmemopen failed: %s", strerror(errno));
 		return NULL;
 	}
 
+	struct kanshi_config *config = calloc(1, sizeof(*config));
+	if (config == NULL) {
+		fclose(f);
+		return NULL;
+	}
+	wl_list_init(&config->profiles);
+	wl_list_init(&config->profile_templates);
+	wl_list_init(&config->output_templates);
+
+	struct kanshi_parser parser = {
+		.f = f,
+		.next = -1,
+		.line = 1,
+	};
+
+	errno = 0;
+	bool res = _parse_config(&parser, config);
+	fclose(f);
+	if (!res) {
+		kanshi_log(KANSHI_LOG_ERROR, "failed to parse config: "
+			"error on line %d, column %d", parser.line, parser.col);
+		destroy_config(config);
+		return NULL;
+	}
+
+	return config;
+}
+
+// Accepts either complete profiles or the directives of a single profile
+struct kanshi_config *parse_override_str(const char *str) {
+	const char *p = str;
+	while (isspace((unsigned char)*p)) {
+		p++;
+	}
+	if (p[0] == '{' || strncmp(p, "profile", strlen("profile")) == 0) {
+		return parse_config_str(str);
+	}
+
+	const char fmt[] = "profile adhoc {\n%s\n}\n";
+	size_t len = strlen(fmt) + strlen(str);
+	char *wrapped = malloc(len);
+	if (wrapped == NULL) {
+		return NULL;
+	}
+	snprintf(wrapped, len, fmt, str);
+	struct kanshi_config *config = parse_config_str(wrapped);
+	free(wrapped);
 	return config;
 }
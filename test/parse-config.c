@@ -0,0 +1,38 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "config.h"
+#include "log.h"
+#include "parser.h"
+
+// Parses the configs given as arguments and frees them, so that sanitizers
+// can check the parser. With --invalid, the configs must be rejected.
+int main(int argc, char *argv[]) {
+	bool invalid = argc > 1 && strcmp(argv[1], "--invalid") == 0;
+	int first = invalid ? 2 : 1;
+	if (first >= argc) {
+		fprintf(stderr, "usage: %s [--invalid] <config...>\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	if (!kanshi_log_init(KANSHI_LOG_ERROR, KANSHI_LOG_SILENT, 0)) {
+		return EXIT_FAILURE;
+	}
+
+	int ret = EXIT_SUCCESS;
+	for (int i = first; i < argc; i++) {
+		struct kanshi_config *config = parse_config(argv[i]);
+		if ((config == NULL) != invalid) {
+			fprintf(stderr, "%s: config unexpectedly %s\n", argv[i],
+				invalid ? "accepted" : "rejected");
+			ret = EXIT_FAILURE;
+		}
+		if (config != NULL) {
+			destroy_config(config);
+		}
+	}
+
+	kanshi_log_finish();
+	return ret;
+}
@@ -0,0 +1,694 @@
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include <wayland-client.h>
+
+#include "config.h"
+#include "kanshi.h"
+#include "log.h"
+#include "trace.h"
+#include "wlr-output-management-unstable-v1-client-protocol.h"
+
+/*
+ * A trace is a text file with one event per line:
+ *
+ *   <time in µs> <object id> <event> [arguments...]
+ *
+ * String arguments are always last and extend until the end of the line.
+ * Config reloads are recorded as "reload" events on object 0.
+ */
+
+struct kanshi_replay_object {
+	uint32_t id;
+	struct wl_proxy *proxy;
+	struct wl_list link;
+};
+
+struct kanshi_replay_configuration {
+	struct zwlr_output_configuration_v1 *config;
+	char *profile_name;
+	bool test;
+	struct wl_list link;
+};
+
+struct kanshi_trace {
+	FILE *f;
+	bool replay;
+	struct timespec start;
+
+	// Only used when replaying
+	int peer_fd;
+	// Requests sent by kanshi, until they are received in full
+	char requests[4096];
+	size_t requests_len;
+	struct wl_list objects; // kanshi_replay_object.link
+	struct wl_list configurations; // kanshi_replay_configuration.link
+	int events, applies, divergences;
+	bool deleted_ids; // sent since the last drain
+	// In trace time, timers fire between the events they precede
+	long long now, timer_deadline;
+};
+
+static long long elapsed_usec(const struct timespec *start) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (long long)(now.tv_sec - start->tv_sec) * 1000000 +
+		(now.tv_nsec - start->tv_nsec) / 1000;
+}
+
+bool kanshi_trace_open(struct kanshi_state *state, const char *path) {
+	struct kanshi_trace *trace = calloc(1, sizeof(*trace));
+	if (trace == NULL) {
+		return false;
+	}
+	trace->f = fopen(path, "w");
+	if (trace->f == NULL) {
+		kanshi_log(KANSHI_LOG_ERROR, "failed to open trace file %s: %s",
+			path, strerror(errno));
+		free(trace);
+		return false;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &trace->start);
+	state->trace = trace;
+	return true;
+}
+
+void kanshi_trace_close(struct kanshi_state *state) {
+	struct kanshi_trace *trace = state->trace;
+	if (trace == NULL) {
+		return;
+	}
+	if (trace->f != NULL) {
+		fclose(trace->f);
+	}
+	if (trace->replay) {
+		close(trace->peer_fd);
+		struct kanshi_replay_object *obj, *tmp_obj;
+		wl_list_for_each_safe(obj, tmp_obj, &trace->objects, link) {
+			wl_list_remove(&obj->link);
+			free(obj);
+		}
+		struct kanshi_replay_configuration *rc, *tmp_rc;
+		wl_list_for_each_safe(rc, tmp_rc, &trace->configurations, link) {
+			wl_list_remove(&rc->link);
+			free(rc->profile_name);
+			free(rc);
+		}
+	}
+	free(trace);
+	state->trace = NULL;
+}
+
+void kanshi_trace_event(struct kanshi_state *state, void *proxy,
+		const char *fmt, ...) {
+	struct kanshi_trace *trace = state->trace;
+	if (trace == NULL || trace->replay) {
+		return;
+	}
+
+	fprintf(trace->f, "%lld %u ", elapsed_usec(&trace->start),
+		wl_proxy_get_id(proxy));
+	va_list args;
+	va_start(args, fmt);
+	vfprintf(trace->f, fmt, args);
+	va_end(args);
+	fputc('\n', trace->f);
+	fflush(trace->f);
+}
+
+void kanshi_trace_reload(struct kanshi_state *state) {
+	struct kanshi_trace *trace = state->trace;
+	if (trace == NULL || trace->replay) {
+		return;
+	}
+
+	fprintf(trace->f, "%lld 0 reload\n", elapsed_usec(&trace->start));
+	fflush(trace->f);
+}
+
+void kanshi_trace_configuration(struct kanshi_state *state,
+		struct zwlr_output_configuration_v1 *config,
+		struct kanshi_profile *profile, bool test) {
+	struct kanshi_trace *trace = state->trace;
+	if (trace == NULL) {
+		return;
+	}
+	if (!trace->replay) {
+		kanshi_trace_event(state, config, "%s %s", test ? "test" : "apply",
+			profile->name);
+		return;
+	}
+
+	// Remember the configuration until the matching "apply" or "test" line
+	// from the trace claims it
+	struct kanshi_replay_configuration *rc = calloc(1, sizeof(*rc));
+	if (rc == NULL) {
+		kanshi_log(KANSHI_LOG_ERROR, "failed to allocate replayed configuration");
+		return;
+	}
+	rc->profile_name = strdup(profile->name);
+	if (rc->profile_name == NULL) {
+		kanshi_log(KANSHI_LOG_ERROR, "failed to allocate replayed configuration");
+		free(rc);
+		return;
+	}
+	rc->config = config;
+	rc->test = test;
+	wl_list_insert(trace->configurations.prev, &rc->link);
+}
+
+void kanshi_replay_set_timer(struct kanshi_state *state, int msec) {
+	struct kanshi_trace *trace = state->trace;
+	trace->timer_deadline = msec < 0 ? -1 : trace->now + (long long)msec * 1000;
+}
+
+bool kanshi_trace_is_replay(struct kanshi_state *state) {
+	return state->trace != NULL && state->trace->replay;
+}
+
+struct wl_display *kanshi_replay_connect(struct kanshi_state *state) {
+	struct kanshi_trace *trace = calloc(1, sizeof(*trace));
+	if (trace == NULL) {
+		return NULL;
+	}
+	trace->replay = true;
+	trace->timer_deadline = -1;
+	wl_list_init(&trace->objects);
+	wl_list_init(&trace->configurations);
+
+	// Requests sent by kanshi end up in the peer socket and are discarded
+	int fds[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) != 0) {
+		kanshi_log(KANSHI_LOG_ERROR, "socketpair failed: %s", strerror(errno));
+		free(trace);
+		return NULL;
+	}
+	int flags = fcntl(fds[1], F_GETFL);
+	fcntl(fds[1], F_SETFL, flags | O_NONBLOCK);
+	trace->peer_fd = fds[1];
+
+	struct wl_display *display = wl_display_connect_to_fd(fds[0]);
+	if (display == NULL) {
+		kanshi_log(KANSHI_LOG_ERROR, "failed to create replay display");
+		close(fds[0]);
+		close(fds[1]);
+		free(trace);
+		return NULL;
+	}
+
+	state->trace = trace;
+	return display;
+}
+
+// Replayed heads and modes get client IDs, like configurations: until the
+// compositor acknowledges their destruction with wl_display.delete_id, the
+// client keeps a zombie around for each of them
+static void replay_delete_id(struct kanshi_trace *trace, uint32_t id) {
+	uint32_t msg[3] = {
+		1, // wl_display
+		(uint32_t)sizeof(msg) << 16 | 1, // delete_id
+		id,
+	};
+	if (write(trace->peer_fd, msg, sizeof(msg)) != sizeof(msg)) {
+		kanshi_log(KANSHI_LOG_ERROR, "failed to send delete_id: %s",
+			strerror(errno));
+		return;
+	}
+	trace->deleted_ids = true;
+}
+
+static bool is_replay_configuration(struct kanshi_trace *trace, uint32_t id) {
+	struct kanshi_replay_configuration *rc;
+	wl_list_for_each(rc, &trace->configurations, link) {
+		if (wl_proxy_get_id((struct wl_proxy *)rc->config) == id) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// Requests are otherwise discarded, but kanshi destroys the configuration
+// heads it creates right away: the compositor deletes their IDs
+static void replay_handle_requests(struct kanshi_trace *trace) {
+	size_t offset = 0;
+	while (trace->requests_len - offset >= 2 * sizeof(uint32_t)) {
+		// Object ID, size << 16 | opcode, arguments
+		uint32_t msg[3];
+		memcpy(msg, trace->requests + offset, 2 * sizeof(uint32_t));
+		size_t size = msg[1] >> 16;
+		if (size < 2 * sizeof(uint32_t)) {
+			kanshi_log(KANSHI_LOG_ERROR, "invalid request size %zu", size);
+			offset = trace->requests_len;
+			break;
+		}
+		if (trace->requests_len - offset < size) {
+			break;
+		}
+		if ((msg[1] & 0xffff) == ZWLR_OUTPUT_CONFIGURATION_V1_ENABLE_HEAD &&
+				size >= sizeof(msg) &&
+				is_replay_configuration(trace, msg[0])) {
+			memcpy(msg, trace->requests + offset, sizeof(msg));
+			replay_delete_id(trace, msg[2]);
+		}
+		offset += size;
+	}
+	trace->requests_len -= offset;
+	memmove(trace->requests, trace->requests + offset, trace->requests_len);
+}
+
+static void replay_drain(struct kanshi_state *state) {
+	struct kanshi_trace *trace = state->trace;
+	wl_display_flush(state->display);
+	ssize_t n;
+	while ((n = read(trace->peer_fd, trace->requests + trace->requests_len,
+			sizeof(trace->requests) - trace->requests_len)) > 0) {
+		trace->requests_len += n;
+		replay_handle_requests(trace);
+	}
+
+	if (trace->deleted_ids) {
+		trace->deleted_ids = false;
+		while (wl_display_prepare_read(state->display) != 0) {
+			wl_display_dispatch_pending(state->display);
+		}
+		wl_display_read_events(state->display);
+		wl_display_dispatch_pending(state->display);
+	}
+}
+
+static void replay_add_object(struct kanshi_trace *trace, uint32_t id,
+		void *proxy) {
+	struct kanshi_replay_object *obj = calloc(1, sizeof(*obj));
+	if (obj == NULL) {
+		kanshi_log(KANSHI_LOG_ERROR, "failed to allocate replayed object");
+		return;
+	}
+	obj->id = id;
+	obj->proxy = proxy;
+	wl_list_insert(&trace->objects, &obj->link);
+}
+
+static struct kanshi_replay_object *replay_find_object(
+		struct kanshi_trace *trace, uint32_t id) {
+	struct kanshi_replay_object *obj;
+	wl_list_for_each(obj, &trace->objects, link) {
+		if (obj->id == id) {
+			return obj;
+		}
+	}
+	return NULL;
+}
+
+// Removes the object from the map: the proxy is about to be destroyed
+static struct wl_proxy *replay_take_object(struct kanshi_trace *trace,
+		uint32_t id) {
+	struct kanshi_replay_object *obj = replay_find_object(trace, id);
+	if (obj == NULL) {
+		return NULL;
+	}
+	struct wl_proxy *proxy = obj->proxy;
+	wl_list_remove(&obj->link);
+	free(obj);
+	return proxy;
+}
+
+static const char *configuration_verb(bool test) {
+	return test ? "tested" : "applied";
+}
+
+static bool replay_claim_configuration(struct kanshi_trace *trace,
+		uint32_t id, const char *profile_name, bool test) {
+	if (wl_list_empty(&trace->configurations)) {
+		kanshi_log(KANSHI_LOG_ERROR, "replay diverged: recorded profile '%s' was %s, "
+			"replayed state didn't send anything", profile_name,
+			configuration_verb(test));
+		trace->divergences++;
+		return true;
+	}
+
+	struct kanshi_replay_configuration *rc = wl_container_of(
+		trace->configurations.next, rc, link);
+	if (strcmp(rc->profile_name, profile_name) != 0 || rc->test != test) {
+		kanshi_log(KANSHI_LOG_ERROR, "replay diverged: recorded profile '%s' was %s, "
+			"replayed state %s '%s'", profile_name, configuration_verb(test),
+			configuration_verb(rc->test), rc->profile_name);
+		trace->divergences++;
+	}
+	replay_add_object(trace, id, rc->config);
+	if (!test) {
+		trace->applies++;
+	}
+	wl_list_remove(&rc->link);
+	free(rc->profile_name);
+	free(rc);
+	return true;
+}
+
+// Parses the config again and applies it, like kanshictl reload
+static bool replay_reload(struct kanshi_state *state) {
+	struct kanshi_daemon *daemon = state->daemon;
+	if (!kanshi_reload_config(daemon)) {
+		return false;
+	}
+	// Waits for the config to be parsed, like the event loop
+	struct pollfd fd = { .fd = daemon->reload_fds[0], .events = POLLIN };
+	while (poll(&fd, 1, -1) == -1) {
+		if (errno != EINTR) {
+			kanshi_log(KANSHI_LOG_ERROR, "poll failed: %s", strerror(errno));
+			return false;
+		}
+	}
+	char buf[64];
+	while (read(daemon->reload_fds[0], buf, sizeof(buf)) > 0) {
+		// Only used to wake up the event loop
+	}
+	return kanshi_handle_reload(daemon);
+}
+
+static bool replay_event(struct kanshi_state *state,
+		struct wl_registry *registry, uint32_t id, const char *event,
+		const char *args) {
+	struct kanshi_trace *trace = state->trace;
+
+	if (strcmp(event, "bind") == 0) {
+		if (state->output_manager != NULL) {
+			// The trace is replayed again, see --replay-loops
+			return true;
+		}
+		uint32_t version;
+		if (sscanf(args, "%u", &version) != 1) {
+			return false;
+		}
+		const struct wl_registry_listener *listener =
+			wl_proxy_get_listener((struct wl_proxy *)registry);
+		listener->global(state, registry, 1,
+			zwlr_output_manager_v1_interface.name, version);
+		if (state->output_manager == NULL) {
+			return false;
+		}
+		replay_add_object(trace, id, state->output_manager);
+		return true;
+	} else if (strcmp(event, "apply") == 0) {
+		return replay_claim_configuration(trace, id, args, false);
+	} else if (strcmp(event, "test") == 0) {
+		return replay_claim_configuration(trace, id, args, true);
+	} else if (strcmp(event, "reload") == 0) {
+		return replay_reload(state);
+	}
+
+	struct kanshi_replay_object *obj = replay_find_object(trace, id);
+	if (obj == NULL) {
+		kanshi_log(KANSHI_LOG_ERROR, "unknown object %u", id);
+		return false;
+	}
+	struct wl_proxy *proxy = obj->proxy;
+	const void *listener = wl_proxy_get_listener(proxy);
+	void *data = wl_proxy_get_user_data(proxy);
+
+	if (strncmp(event, "manager.", 8) == 0) {
+		const struct zwlr_output_manager_v1_listener *l = listener;
+		struct zwlr_output_manager_v1 *manager = (void *)proxy;
+		event += 8;
+		if (strcmp(event, "head") == 0) {
+			uint32_t head_id;
+			if (sscanf(args, "%u", &head_id) != 1) {
+				return false;
+			}
+			struct wl_proxy *head =
+				wl_proxy_create(proxy, &zwlr_output_head_v1_interface);
+			replay_add_object(trace, head_id, head);
+			l->head(data, manager, (void *)head);
+		} else if (strcmp(event, "done") == 0) {
+			uint32_t serial;
+			if (sscanf(args, "%u", &serial) != 1) {
+				return false;
+			}
+			l->done(data, manager, serial);
+		} else if (strcmp(event, "finished") == 0) {
+			l->finished(data, manager);
+		} else {
+			return false;
+		}
+	} else if (strncmp(event, "head.", 5) == 0) {
+		const struct zwlr_output_head_v1_listener *l = listener;
+		struct zwlr_output_head_v1 *head = (void *)proxy;
+		event += 5;
+		int32_t a, b;
+		uint32_t mode_id;
+		if (strcmp(event, "name") == 0) {
+			l->name(data, head, args);
+		} else if (strcmp(event, "description") == 0) {
+			l->description(data, head, args);
+		} else if (strcmp(event, "make") == 0) {
+			l->make(data, head, args);
+		} else if (strcmp(event, "model") == 0) {
+			l->model(data, head, args);
+		} else if (strcmp(event, "serial_number") == 0) {
+			l->serial_number(data, head, args);
+		} else if (strcmp(event, "physical_size") == 0) {
+			if (sscanf(args, "%d %d", &a, &b) != 2) {
+				return false;
+			}
+			l->physical_size(data, head, a, b);
+		} else if (strcmp(event, "mode") == 0) {
+			if (sscanf(args, "%u", &mode_id) != 1) {
+				return false;
+			}
+			struct wl_proxy *mode =
+				wl_proxy_create(proxy, &zwlr_output_mode_v1_interface);
+			replay_add_object(trace, mode_id, mode);
+			l->mode(data, head, (void *)mode);
+		} else if (strcmp(event, "enabled") == 0) {
+			if (sscanf(args, "%d", &a) != 1) {
+				return false;
+			}
+			l->enabled(data, head, a);
+		} else if (strcmp(event, "current_mode") == 0) {
+			if (sscanf(args, "%u", &mode_id) != 1) {
+				return false;
+			}
+			struct kanshi_replay_object *mode =
+				replay_find_object(trace, mode_id);
+			if (mode == NULL) {
+				return false;
+			}
+			l->current_mode(data, head, (void *)mode->proxy);
+		} else if (strcmp(event, "position") == 0) {
+			if (sscanf(args, "%d %d", &a, &b) != 2) {
+				return false;
+			}
+			l->position(data, head, a, b);
+		} else if (strcmp(event, "transform") == 0) {
+			if (sscanf(args, "%d", &a) != 1) {
+				return false;
+			}
+			l->transform(data, head, a);
+		} else if (strcmp(event, "scale") == 0) {
+			if (sscanf(args, "%d", &a) != 1) {
+				return false;
+			}
+			l->scale(data, head, a);
+		} else if (strcmp(event, "adaptive_sync") == 0) {
+			if (sscanf(args, "%d", &a) != 1) {
+				return false;
+			}
+			l->adaptive_sync(data, head, a);
+		} else if (strcmp(event, "finished") == 0) {
+			replay_take_object(trace, id);
+			uint32_t proxy_id = wl_proxy_get_id(proxy);
+			l->finished(data, head);
+			replay_delete_id(trace, proxy_id);
+		} else {
+			return false;
+		}
+	} else if (strncmp(event, "mode.", 5) == 0) {
+		const struct zwlr_output_mode_v1_listener *l = listener;
+		struct zwlr_output_mode_v1 *mode = (void *)proxy;
+		event += 5;
+		int32_t a, b;
+		if (strcmp(event, "size") == 0) {
+			if (sscanf(args, "%d %d", &a, &b) != 2) {
+				return false;
+			}
+			l->size(data, mode, a, b);
+		} else if (strcmp(event, "refresh") == 0) {
+			if (sscanf(args, "%d", &a) != 1) {
+				return false;
+			}
+			l->refresh(data, mode, a);
+		} else if (strcmp(event, "preferred") == 0) {
+			l->preferred(data, mode);
+		} else if (strcmp(event, "finished") == 0) {
+			replay_take_object(trace, id);
+			uint32_t proxy_id = wl_proxy_get_id(proxy);
+			l->finished(data, mode);
+			replay_delete_id(trace, proxy_id);
+		} else {
+			return false;
+		}
+	} else if (strncmp(event, "config.", 7) == 0) {
+		const struct zwlr_output_configuration_v1_listener *l = listener;
+		struct zwlr_output_configuration_v1 *config = (void *)proxy;
+		event += 7;
+		replay_take_object(trace, id);
+		uint32_t proxy_id = wl_proxy_get_id(proxy);
+		if (strcmp(event, "succeeded") == 0) {
+			l->succeeded(data, config);
+		} else if (strcmp(event, "failed") == 0) {
+			l->failed(data, config);
+		} else if (strcmp(event, "cancelled") == 0) {
+			l->cancelled(data, config);
+		} else {
+			return false;
+		}
+		replay_delete_id(trace, proxy_id);
+	} else {
+		return false;
+	}
+
+	return true;
+}
+
+// Allocators don't give memory back right away, leaking even a single
+// allocation per loop still adds up to more than this after a few thousand
+// loops
+#define REPLAY_RSS_SLACK_KIB 128
+
+// Resident set size in KiB, -1 if unknown
+static long resident_kib(void) {
+	FILE *f = fopen("/proc/self/statm", "r");
+	if (f == NULL) {
+		return -1;
+	}
+	long size, resident;
+	int n = fscanf(f, "%ld %ld", &size, &resident);
+	fclose(f);
+	if (n != 2) {
+		return -1;
+	}
+	return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+// Returns false if the trace couldn't be replayed
+static bool replay_pass(struct kanshi_state *state,
+		struct wl_registry *registry, FILE *f) {
+	struct kanshi_trace *trace = state->trace;
+
+	// Each pass starts where the previous one ended, in trace time
+	long long offset = trace->now;
+	bool ok = true;
+	char *line = NULL;
+	size_t line_size = 0;
+	int lineno = 0;
+	ssize_t n;
+	while ((n = getline(&line, &line_size, f)) > 0) {
+		lineno++;
+		if (line[n - 1] == '\n') {
+			line[n - 1] = '\0';
+		}
+
+		long long time;
+		uint32_t id;
+		char event[64];
+		int args_offset = 0;
+		if (sscanf(line, "%lld %u %63s %n", &time, &id, event,
+				&args_offset) < 3) {
+			kanshi_log(KANSHI_LOG_ERROR, "invalid trace event on line %d",
+				lineno);
+			ok = false;
+			break;
+		}
+		const char *args = line + args_offset;
+		time += offset;
+
+		while (trace->timer_deadline >= 0 && trace->timer_deadline <= time) {
+			trace->now = trace->timer_deadline;
+			trace->timer_deadline = -1;
+			kanshi_handle_timer(state);
+			replay_drain(state);
+		}
+		trace->now = time;
+
+		if (!replay_event(state, registry, id, event, args)) {
+			kanshi_log(KANSHI_LOG_ERROR, "failed to replay event '%s' on line %d",
+				event, lineno);
+			ok = false;
+			break;
+		}
+		trace->events++;
+		replay_drain(state);
+	}
+	free(line);
+	return ok;
+}
+
+int kanshi_replay(struct kanshi_state *state, struct wl_registry *registry,
+		const char *path, int loops) {
+	struct kanshi_trace *trace = state->trace;
+
+	FILE *f = fopen(path, "r");
+	if (f == NULL) {
+		kanshi_log(KANSHI_LOG_ERROR, "failed to open trace file %s: %s",
+			path, strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &trace->start);
+
+	// Memory used after the warm-up loops should stay the same until the
+	// end, otherwise something leaks
+	int warmup = loops / 10 > 0 ? loops / 10 : 1;
+	long warmup_rss = -1;
+	int ret = EXIT_SUCCESS;
+	for (int i = 0; i < loops; i++) {
+		rewind(f);
+		if (!replay_pass(state, registry, f)) {
+			ret = EXIT_FAILURE;
+			break;
+		}
+		if (i + 1 == warmup) {
+			warmup_rss = resident_kib();
+		}
+	}
+	fclose(f);
+
+	struct kanshi_replay_configuration *rc;
+	wl_list_for_each(rc, &trace->configurations, link) {
+		kanshi_log(KANSHI_LOG_ERROR, "replay diverged: replayed state %s '%s', "
+			"recorded state didn't send anything",
+			configuration_verb(rc->test), rc->profile_name);
+		trace->divergences++;
+	}
+
+	long long elapsed = elapsed_usec(&trace->start);
+	kanshi_log(KANSHI_LOG_INFO, "replayed %d events in %lld.%03lld ms: "
+		"%d configurations applied, %d divergences",
+		trace->events, elapsed / 1000, elapsed % 1000,
+		trace->applies, trace->divergences);
+	if (trace->divergences > 0) {
+		ret = EXIT_FAILURE;
+	}
+
+	if (loops > 1 && ret == EXIT_SUCCESS) {
+		long rss = resident_kib();
+		kanshi_log(KANSHI_LOG_INFO, "resident memory: %ld KiB after %d "
+			"warm-up loops, %ld KiB after %d loops", warmup_rss, warmup,
+			rss, loops);
+		// The config is parsed on a new thread on each reload, leaks are
+		// left to LeakSanitizer
+		if (!KANSHI_HAS_ASAN && rss > warmup_rss + REPLAY_RSS_SLACK_KIB) {
+			kanshi_log(KANSHI_LOG_ERROR, "resident memory grew by %ld KiB "
+				"after the warm-up loops", rss - warmup_rss);
+			ret = EXIT_FAILURE;
+		}
+	}
+	return ret;
+}